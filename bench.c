@@ -0,0 +1,116 @@
+/*
+
+    nh3 - A Programming Language
+    Copyright (C) 2003/2013 Angel Ortega <angel@triptico.com>
+
+    bench.c - Benchmarks.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+    http://www.triptico.com
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nh3.h"
+
+/* total running time */
+double total = 0.0;
+
+
+void do_bench(char *name, char *prg)
+{
+    mpdm_t v;
+    clock_t t;
+    double secs;
+
+    mpdm_hset_s(mpdm_root(), L"ERROR", NULL);
+
+    v = mpdm_ref(nh3_compile(MPDM_MBS(prg)));
+
+    if (v != NULL) {
+        t = clock();
+        mpdm_void(mpdm_exec(v, NULL, NULL));
+        secs = (double) (clock() - t) / CLOCKS_PER_SEC;
+        total += secs;
+
+        printf("%-24s %8.3f secs", name, secs);
+    }
+    else
+        printf("%-24s %8s", name, "-");
+
+    if (mpdm_hget_s(mpdm_root(), L"ERROR") != NULL) {
+        printf(" (error: ");
+        mpdm_write_wcs(stdout, mpdm_string(mpdm_hget_s(mpdm_root(), L"ERROR")));
+        printf(")");
+    }
+
+    printf("\n");
+
+    mpdm_unref(v);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int hits, misses;
+
+    nh3_startup(argc, argv);
+
+    do_bench("counter loop",
+        "var n = 0; while (n < 1000000) n = n + 1;");
+    do_bench("compound assignment",
+        "var n = 0; while (n < 1000000) n += 1;");
+    do_bench("preincrement",
+        "var n = 0; while (n < 1000000) ++n;");
+    do_bench("real arithmetic",
+        "var n = 0, r = 0; while (n < 500000) { r = r + n * 0.5; n = n + 1; }");
+    do_bench("array subscript",
+        "var a = [1, 2, 3, 4, 5, 6, 7, 8], n = 0, s = 0; "
+        "while (n < 500000) { s = s + a[n & 7]; n = n + 1; }");
+    do_bench("subroutine calls",
+        "sub add1(x) { return x + 1; } var n = 0; while (n < 200000) n = add1(n);");
+    do_bench("method calls",
+        "var s = 'abcd', n = 0, l = 0; while (n < 200000) { l = l + s.size(); n = n + 1; }");
+    do_bench("foreach",
+        "var s = 0; foreach 500000 s = s + value;");
+    do_bench("array foreach",
+        "var a = [], n = 0; while (n < 200000) { a.push(n); ++n; } var s = 0; foreach a s += key + value;");
+    do_bench("range foreach",
+        "var s = 0; foreach range(1, 200000) s += value;");
+    do_bench("generator",
+        "sub c(n) { var i = 0; while (i < n) { yield i; ++i; } } var s = 0; foreach c(200000) s += value;");
+    do_bench("literal tables",
+        "sub t(i) { var l = [1, 2, 3, 4, 5, 6, 7, 8, 9, 10]; return l[i]; } "
+        "var n = 0, s = 0; while (n < 100000) { s = s + t(n % 10); n = n + 1; }");
+    do_bench("literal subscript",
+        "var n = 0, s = 0; while (n < 100000) { s = s + [1, 2, 3, 4, 5, 6, 7, 8, 9, 10][n % 10]; n = n + 1; }");
+    do_bench("constant expressions",
+        "var n = 0, s = 0; while (n < 200000) { s = s + (60 * 60 * 24) % 7 + { a: 1, b: 2, c: 3 }.b; n = n + 1; }");
+    do_bench("spawns",
+        "sub one(c) { c.write(1); } var n = 0, s = 0; while (n < 20000) { var c = &one; s = s + c.read(); n = n + 1; }");
+
+    printf("\n%-24s %8.3f secs\n", "total", total);
+
+    nh3_ic_stats(&hits, &misses);
+    printf("%-24s %d hits, %d misses\n", "inline caches", hits, misses);
+
+    nh3_shutdown();
+
+    return 0;
+}
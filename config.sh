@@ -33,6 +33,8 @@ while [ $# -gt 0 ] ; do
     --docdir)   DOCDIR=$2 ; shift ;;
     --docdir=*) DOCDIR=`echo $1 | sed -e 's/--docdir=//'` ;;
 
+    --without-computed-goto)    WITHOUT_COMPUTED_GOTO=1 ;;
+
     esac
 
     shift
@@ -44,6 +46,7 @@ if [ "$CONFIG_HELP" = "1" ] ; then
     echo "--prefix=PREFIX       Installation prefix ($PREFIX)."
     echo "--docdir=DOCDIR       Instalation directory for documentation."
     echo "--mingw32             Build using the mingw32 compiler."
+    echo "--without-computed-goto   Use the portable switch() VM dispatch."
 
     echo
     echo "Environment variables:"
@@ -117,6 +120,60 @@ echo "CFLAGS=$CFLAGS" >> makefile.opts
 # Add CFLAGS to CC
 CC="$CC $CFLAGS"
 
+# threaded dispatch for the virtual machine
+echo -n "Testing for computed goto (threaded VM dispatch)... "
+
+if [ "$WITHOUT_COMPUTED_GOTO" = "1" ] ; then
+    echo "Disabled"
+else
+    echo "int main(int argc, char *argv[]) { void *l = &&e; goto *l; e: return 0; }" > .tmp.c
+
+    $CC .tmp.c -o .tmp.o 2>> .config.log
+
+    if [ $? = 0 ] ; then
+        echo "#define CONFOPT_COMPUTED_GOTO 1" >> config.h
+        echo "OK"
+    else
+        echo "No"
+    fi
+fi
+
+# number of processors (for the task workers)
+echo -n "Testing for sysconf()... "
+echo "#include <unistd.h>" > .tmp.c
+echo "int main(int argc, char *argv[]) { return sysconf(_SC_NPROCESSORS_ONLN) < 0; }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_SYSCONF 1" >> config.h
+    echo "OK"
+else
+    echo "No"
+fi
+
+# monotonic clock (for the running time limits)
+echo -n "Testing for clock_gettime()... "
+echo "#include <time.h>" > .tmp.c
+echo "int main(int argc, char *argv[]) { struct timespec ts; return clock_gettime(CLOCK_MONOTONIC, &ts); }" >> .tmp.c
+
+$CC .tmp.c -o .tmp.o 2>> .config.log
+
+if [ $? = 0 ] ; then
+    echo "#define CONFOPT_CLOCK_GETTIME 1" >> config.h
+    echo "OK"
+else
+    $CC .tmp.c -o .tmp.o -lrt 2>> .config.log
+
+    if [ $? = 0 ] ; then
+        echo "#define CONFOPT_CLOCK_GETTIME 1" >> config.h
+        echo "-lrt" >> config.ldflags
+        echo "OK (-lrt)"
+    else
+        echo "No"
+    fi
+fi
+
 # MPDM
 echo -n "Looking for MPDM... "
 
@@ -32,10 +32,18 @@ extern "C" {
 #include "mpdm.h"
 
 enum {
-    VM_IDLE, VM_RUNNING, VM_TIMEOUT, VM_ERROR
+    VM_IDLE, VM_RUNNING, VM_TIMEOUT, VM_ERROR, VM_WAITING, VM_YIELD
 };
 
 mpdm_t nh3_compile(mpdm_t src);
+void nh3_budget(mpdm_t x, int max_ins, int msecs);
+
+struct nh3_vm;
+
+struct nh3_vm *nh3_vm_new(mpdm_t x);
+int nh3_vm_run(struct nh3_vm *m, int max_ins, int msecs);
+void nh3_vm_free(struct nh3_vm *m);
+void nh3_ic_stats(int *hits, int *misses);
 
 void nh3_startup(int argc, char *argv[]);
 void nh3_shutdown(void);
@@ -28,7 +28,14 @@
 #include <stdio.h>
 #include <wchar.h>
 #include <string.h>
-#include <time.h> /* for clock() */
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h> /* for clock_gettime() */
+
+#ifdef CONFOPT_SYSCONF
+#include <unistd.h> /* for sysconf() */
+#endif
 
 #include "nh3.h"
 
@@ -37,8 +44,8 @@
 
 typedef enum {
     T_EOP,    T_ERROR,
-    T_IF,     T_ELSE,    T_WHILE,   T_BREAK,   T_FOREACH,
-    T_VAR,    T_SUB,     T_RETURN,  T_NULL,    T_THIS,
+    T_IF,     T_ELSE,    T_WHILE,   T_BREAK,   T_FOREACH, T_PFOREACH,
+    T_VAR,    T_SUB,     T_RETURN,  T_YIELD,   T_NULL,    T_THIS,
     T_LBRACE, T_RBRACE,  T_LPAREN,  T_RPAREN,  T_LBRACK,  T_RBRACK,
     T_COLON,  T_SEMI,    T_DOT,     T_COMMA,
     T_GT,     T_LT,      T_PIPE,    T_AMP,
@@ -51,7 +58,7 @@ typedef enum {
     T_DGTEQ,  T_DLTEQ,   T_DPIPEEQ, T_DAMPEQ,
     T_THARRW, T_FATARRW, T_VIRARRW, T_COLARRW,
     T_SYMBOL, T_LITERAL, T_BLANK,   T_SLASHAST, T_DSLASH,
-    T_SQUOTE, T_DQUOTE,  T_DOLLAR,  T_VIREQ
+    T_SQUOTE, T_DQUOTE,  T_DOLLAR,  T_VIREQ,   T_NUMBER
 } nh3_token_t;
 
 
@@ -63,7 +70,21 @@ struct nh3_c {
     int token_i;        /* token size */
     int token_o;        /* offset to end of token */
     mpdm_t node;        /* generated nodes */
-    mpdm_t prg;         /* generated program */
+    int32_t *code;      /* generated code */
+    int code_i;         /* code allocated size */
+    int code_o;         /* code size */
+    int32_t *lines;     /* line table (pc, line pairs) */
+    int lines_i;        /* line table allocated size */
+    int lines_o;        /* line table size */
+    mpdm_t pool;        /* constant pool */
+    mpdm_t subs;        /* pool indexes of subroutine addresses */
+    mpdm_t dyn;         /* names that must be resolved dynamically */
+    mpdm_t scope;       /* stack of scopes (name to frame slot) */
+    int slots;          /* frame slots used by current subroutine */
+    int tlt;            /* non-zero if it creates names in its symbol table */
+    int tail;           /* non-zero if generating a call in tail position */
+    int sites;          /* symbol lookup sites (inline caches) */
+    int member;         /* non-zero if generating a member name */
     int x;              /* x source position */
     int y;              /* y source position */
     wchar_t c;          /* last char read from input */
@@ -139,7 +160,7 @@ static struct {
     { L'>', T_COLARRW,  T_COLON },
     { L'>', T_DGT,      T_GT    },  { L'=', T_GTEQ,      T_GT    },
     { L'=', T_DGTEQ,    T_DGT   },
-    { L'<', T_DLT,      T_LT    },  { L'=', T_GTEQ,      T_LT    },
+    { L'<', T_DLT,      T_LT    },  { L'=', T_LTEQ,      T_LT    },
     { L'=', T_DLTEQ,    T_DLT   },
     { L'|', T_DPIPE,    T_PIPE  },  { L'=', T_PIPEEQ,    T_PIPE  },
     { L'=', T_DPIPEEQ,  T_DPIPE },
@@ -256,7 +277,7 @@ again:
     default:
         if (t == T_ERROR) {
             if (DIGIT(c->c)) {
-                t = T_LITERAL;
+                t = T_NUMBER;
 
                 if (c->c == L'0') {
                     POKE(c, c->c); nc(c);
@@ -303,9 +324,11 @@ again:
                 STOKEN(L"var",      T_VAR);
                 STOKEN(L"sub",      T_SUB);
                 STOKEN(L"return",   T_RETURN);
+                STOKEN(L"yield",    T_YIELD);
                 STOKEN(L"NULL",     T_NULL);
                 STOKEN(L"this",     T_THIS);
                 STOKEN(L"foreach",  T_FOREACH);
+                STOKEN(L"pforeach", T_PFOREACH);
 
                 if (t == T_ERROR) t = T_SYMBOL;
             }
@@ -325,7 +348,7 @@ again:
 
 typedef enum {
     /* order matters (operator precedence) */
-    N_NULL,   N_LITERAL,
+    N_NULL,   N_LITERAL, N_NUMBER,
     N_ARRAY,  N_HASH,   N_FUNCAL, N_SPAWN,
     N_PARTOF, N_SUBSCR, 
     N_UMINUS, N_NOT,
@@ -341,7 +364,7 @@ typedef enum {
     N_IBAND,  N_IBOR,   N_IXOR, N_ORASSIGN,
     N_PINC,   N_PDEC,   N_SINC, N_SDEC,
     N_THIS,   N_VAR,
-    N_SUBDEF, N_RETURN,
+    N_SUBDEF, N_RETURN, N_YIELD,
     N_VOID,   N_LINEINFO,
     N_EOP
 } nh3_node_t;
@@ -536,6 +559,11 @@ static mpdm_t term(struct nh3_c *c)
         token(c);
     }
     else
+    if (c->token == T_NUMBER) {
+        v = node1(N_NUMBER, tstr(c));
+        token(c);
+    }
+    else
     if (c->token == T_SYMBOL) {
         v = node1(N_SYMID, tstr(c));
         token(c);
@@ -685,6 +713,148 @@ static mpdm_t var(struct nh3_c *c)
 }
 
 
+static mpdm_t pfold(mpdm_t a, mpdm_t ctxt);
+
+#define SYMVAL(s) node1(N_SYMVAL, node1(N_SYMID, s))
+
+static mpdm_t partial(int n)
+/* returns the n-th partial result of a pforeach chunk */
+{
+    return node1(N_SYMVAL, node2(N_SUBSCR, SYMVAL(MPDM_LS(L"value")),
+        node1(N_LITERAL, MPDM_I(n))));
+}
+
+
+static mpdm_t reduction(mpdm_t x, mpdm_t op, int n)
+/* returns the statement that merges the n-th partial result into x;
+   op is the name of a builtin reduction or a subroutine node */
+{
+    mpdm_t v, w;
+    int min = 0;
+
+    if (!MPDM_IS_ARRAY(op) && mpdm_cmp_s(op, L"sum") == 0)
+        return node1(N_VOID, node2(N_ASSIGN, node1(N_SYMID, x),
+            node2(N_ADD, SYMVAL(x), partial(n))));
+
+    if (!MPDM_IS_ARRAY(op) &&
+        ((min = (mpdm_cmp_s(op, L"min") == 0)) || mpdm_cmp_s(op, L"max") == 0)) {
+        v = node2(min ? N_LT : N_GT, partial(n), SYMVAL(x));
+        v = node2(N_OR, node2(N_EQ, SYMVAL(x), node0(N_NULL)), v);
+        v = node2(N_AND, node2(N_NE, partial(n), node0(N_NULL)), v);
+
+        return node2(N_IF, v,
+            node1(N_VOID, node2(N_ASSIGN, node1(N_SYMID, x), partial(n))));
+    }
+
+    if (!MPDM_IS_ARRAY(op))
+        w = node2(N_JOIN, SYMVAL(x), partial(n));
+    else {
+        /* subroutine */
+        w = RF(node0(N_ARRAY));
+        mpdm_push(w, SYMVAL(x));
+        mpdm_push(w, partial(n));
+        w = node2(N_FUNCAL, UFND(w), op);
+    }
+
+    /* the first non-NULL partial result is taken as is */
+    v = RF(node2(N_IF, node2(N_EQ, SYMVAL(x), node0(N_NULL)),
+        node1(N_VOID, node2(N_ASSIGN, node1(N_SYMID, x), partial(n)))));
+    mpdm_push(v, node1(N_VOID, node2(N_ASSIGN, node1(N_SYMID, x), w)));
+
+    return node2(N_IF, node2(N_NE, partial(n), node0(N_NULL)), UFND(v));
+}
+
+
+static mpdm_t pforeach(struct nh3_c *c)
+/* returns a pforeach statement: the body is run as a subroutine over
+   chunks of the set in parallel (see pfold()), and the partial results
+   of the reduction variables are merged afterwards (if no chunk failed
+   or ran out of budget, as the fold returns NULL then) */
+{
+    mpdm_t a, i, r, v, w;
+    int n;
+
+    a = RF(MPDM_A(0));
+    i = RF(node0(N_ARRAY));
+    r = RF(node0(N_ARRAY));
+    w = RF(node0(N_NOP));
+
+    mpdm_push(a, MPDM_LS(L"value"));
+    mpdm_push(a, MPDM_LS(L"key"));
+
+    /* reduction variables: (name: op, ...) */
+    if (c->token == T_LPAREN)
+        token(c);
+    else
+        c_error(c);
+
+    for (n = 0; !c->error && c->token == T_SYMBOL; n++) {
+        mpdm_t x = RF(tstr(c));
+
+        v = NULL;
+        token(c);
+
+        if (c->token == T_COLON) {
+            token(c);
+
+            if (c->token == T_SYMBOL && (
+                wcscmp(c->token_s, L"sum") == 0 || wcscmp(c->token_s, L"min") == 0 ||
+                wcscmp(c->token_s, L"max") == 0 || wcscmp(c->token_s, L"concat") == 0)) {
+                v = tstr(c);
+                token(c);
+            }
+            else
+                v = expr(c);
+        }
+
+        if (v == NULL)
+            c_error(c);
+        else {
+            mpdm_push(a, x);
+            mpdm_push(r, SYMVAL(x));
+
+            /* the private copies start empty (or at 0, for sums) */
+            mpdm_push(i, MPDM_IS_ARRAY(v) || mpdm_cmp_s(v, L"sum") != 0 ?
+                node0(N_NULL) : node1(N_LITERAL, MPDM_I(0)));
+
+            mpdm_set(&w, node2(N_SEQ, w, reduction(x, v, n)));
+        }
+
+        UF(x);
+
+        if (c->token == T_COMMA)
+            token(c);
+    }
+
+    if (c->token == T_RPAREN)
+        token(c);
+    else
+        c_error(c);
+
+    v = NULL;
+
+    if (!c->error && (v = expr(c)) != NULL) {
+        mpdm_t l = RF(node0(N_ARRAY));
+
+        /* body, returning the partial results */
+        mpdm_push(l, v);
+        mpdm_push(l, node2(N_SUBDEF, node1(N_LITERAL, a),
+            node2(N_SEQ, statement(c), node1(N_RETURN, r))));
+        mpdm_push(l, i);
+
+        v = node2(N_FOREACH,
+            node2(N_FUNCAL, UFND(l), node1(N_LITERAL, MPDM_X(pfold))), w);
+    }
+
+    UF(w);
+    UF(r);
+    UF(i);
+    UF(a);
+
+    return v;
+}
+
+
 static mpdm_t statement(struct nh3_c *c)
 /* returns a statement */
 {
@@ -722,6 +892,11 @@ static mpdm_t statement(struct nh3_c *c)
             v = node2(N_FOREACH, w, statement(c));
     }
     else
+    if (c->token == T_PFOREACH) {
+        token(c);
+        v = pforeach(c);
+    }
+    else
     if (c->token == T_VAR) {
         mpdm_t w1, w2;
 
@@ -780,10 +955,12 @@ static mpdm_t statement(struct nh3_c *c)
         }
     }
     else
-    if (c->token == T_RETURN) {
+    if (c->token == T_RETURN || c->token == T_YIELD) {
+        nh3_node_t n = c->token == T_RETURN ? N_RETURN : N_YIELD;
+
         token(c);
 
-        v = node1(N_RETURN, c->token == T_SEMI ? node0(N_NULL) : expr(c));
+        v = node1(n, c->token == T_SEMI ? node0(N_NULL) : expr(c));
 
         if (c->token == T_SEMI)
             token(c);
@@ -873,549 +1050,3912 @@ typedef enum {
     OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
     OP_NOT, OP_EQ,  OP_GT,  OP_GE,  OP_LT, OP_LE,
     OP_REM, OP_CAT, OP_ITE, OP_FMT,
-    OP_LNI, OP_FRK,
+    OP_FRK,
+    OP_ENT, OP_LDL, OP_STL,
+    OP_JT,  OP_NE,  OP_NEG,
+    OP_INC, OP_DEC, OP_ADL, OP_SBL, OP_GMS,
+    OP_JEQ, OP_JNE, OP_JGT, OP_JGE, OP_JLT, OP_JLE,
+    OP_CLN, OP_FRM, OP_TCL, OP_ITS, OP_GEN, OP_YLD,
+    OP_GTL,
     OP_NOP
 } nh3_op_t;
 
 static int opcode_argc[] = {
     0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+    0, 0, 1, 0, 0, 0, 0, 0, 0, 1, 1, 1,
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 1, 0, 1, 0, 1, 0, 0
+    0, 0, 0, 0, 1, 0, 1, 0, 0, 1, 1, 1,
+    1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 2, 1, 2, 0, 0, 1, 0
 };
 
-static int o(struct nh3_c *c, nh3_op_t op) { mpdm_push(c->prg, MPDM_I(op)); return mpdm_size(c->prg); }
-static int o2(struct nh3_c *c, nh3_op_t op, mpdm_t v) { int r = o(c, op); mpdm_push(c->prg, v); return r; }
-static void fix(struct nh3_c *c, int n) { mpdm_aset(c->prg, MPDM_I(mpdm_size(c->prg)), n); }
-static int here(struct nh3_c *c) { return mpdm_size(c->prg); }
-#define O(n) gen(c, mpdm_aget(node, n))
-
-
-static int gen(struct nh3_c *c, mpdm_t node)
-/* generates nh3 VM code from a tree of nodes */
+static void emit(struct nh3_c *c, int32_t i)
+/* appends an instruction word to the code */
 {
-    int n, i;
+    if (c->code_o == c->code_i) {
+        c->code_i = c->code_i ? c->code_i * 2 : 256;
+        c->code = realloc(c->code, c->code_i * sizeof(int32_t));
+    }
 
-    nh3_node_t nt = mpdm_ival(mpdm_aget(node, 0));
+    c->code[c->code_o++] = i;
+}
 
-    switch (nt) {
-    case N_NOP:     break;
-    case N_EOP:     o(c, OP_RET); break;
-    case N_NULL:    o(c, OP_NUL); break;
-    case N_SYMID:   o2(c, OP_LIT, mpdm_aget(node, 1)); o(c, OP_TBL); break;
-    case N_LITERAL: o2(c, OP_LIT, mpdm_aget(node, 1)); break;
-    case N_SEQ:     O(1); O(2); break;
-    case N_ADD:     O(1); O(2); o(c, OP_ADD); break;
-    case N_SUB:     O(1); O(2); o(c, OP_SUB); break;
-    case N_MUL:     O(1); O(2); o(c, OP_MUL); break;
-    case N_DIV:     O(1); O(2); o(c, OP_DIV); break;
-    case N_MOD:     O(1); O(2); o(c, OP_MOD); break;
-    case N_UMINUS:  o2(c, OP_LIT, MPDM_I(-1)); O(1); o(c, OP_MUL); break;
-    case N_NOT:     O(1); o(c, OP_NOT); break;
-    case N_EQ:      O(1); O(2); o(c, OP_EQ); break;
-    case N_NE:      O(1); O(2); o(c, OP_EQ); o(c, OP_NOT); break;
-    case N_GT:      O(1); O(2); o(c, OP_GT); break;
-    case N_GE:      O(1); O(2); o(c, OP_GE); break;
-    case N_LT:      O(1); O(2); o(c, OP_LT); break;
-    case N_LE:      O(1); O(2); o(c, OP_LE); break;
-    case N_ASSIGN:  O(1); O(2); o(c, OP_SET); break;
-    case N_SYMVAL:  O(1); o(c, OP_GET); break;
-    case N_PARTOF:  O(1); o(c, OP_TPU); O(2); o(c, OP_TPO); break;
-    case N_THIS:    o(c, OP_THS); break;
-    case N_SUBSCR:  O(1); O(2); break;
-    case N_VOID:    O(1); o(c, OP_POP); break;
-    case N_VAR:     o(c, OP_TLT); O(1); break;
-    case N_RETURN:  O(1); o(c, OP_TPO); o(c, OP_RET); break;
-    case N_FUNCAL:  O(1); O(2); o(c, OP_CAL); break;
-    case N_BINAND:  O(1); O(2); o(c, OP_AND); break;
-    case N_BINOR:   O(1); O(2); o(c, OP_OR); break;
-    case N_XOR:     O(1); O(2); o(c, OP_XOR); break;
-    case N_SHL:     O(1); O(2); o(c, OP_SHL); break;
-    case N_SHR:     O(1); O(2); o(c, OP_SHR); break;
-    case N_JOIN:    O(1); O(2); o(c, OP_CAT); break;
-    case N_FMT:     O(1); O(2); o(c, OP_FMT); break;
-    case N_LINEINFO: o2(c, OP_LNI, mpdm_aget(node, 2)); O(1); break;
-    case N_SPAWN:   O(1); o(c, OP_FRK); break;
+static void line(struct nh3_c *c, int l)
+/* marks the code from here as belonging to source line l */
+{
+    /* only changes are stored */
+    if (c->lines_o && c->lines[c->lines_o - 1] == l)
+        return;
+
+    /* nothing generated since the last one? replace it */
+    if (c->lines_o && c->lines[c->lines_o - 2] == c->code_o) {
+        c->lines[c->lines_o - 1] = l;
+        return;
+    }
 
-    case N_ARRAY:
-        o(c, OP_ARR);
-        for (n = 1; n < mpdm_size(node); n++) {
-            O(n);
-            o(c, OP_APU);
-        }
-        break;
+    if (c->lines_o == c->lines_i) {
+        c->lines_i = c->lines_i ? c->lines_i * 2 : 64;
+        c->lines = realloc(c->lines, c->lines_i * sizeof(int32_t));
+    }
 
-    case N_HASH:
-        o(c, OP_HSH);
-        for (n = 1; n < mpdm_size(node); n += 2) {
-            O(n);
-            O(n + 1);
-            o(c, OP_STI);
-        }
-        break;
+    c->lines[c->lines_o++] = c->code_o;
+    c->lines[c->lines_o++] = l;
+}
 
-    case N_IF:
-        O(1); n = o2(c, OP_JF, NULL); O(2);
+static int o(struct nh3_c *c, nh3_op_t op) { emit(c, op); return c->code_o; }
+static int o2(struct nh3_c *c, nh3_op_t op, int32_t i) { int r = o(c, op); emit(c, i); return r; }
+static int lit(struct nh3_c *c, mpdm_t v) { mpdm_push(c->pool, v); return o2(c, OP_LIT, mpdm_size(c->pool) - 1); }
+static void fix(struct nh3_c *c, int n) { c->code[n] = c->code_o; }
+static void fixlit(struct nh3_c *c, int n) { mpdm_aset(c->pool, MPDM_I(c->code_o), c->code[n]); mpdm_push(c->subs, MPDM_I(c->code[n])); }
+static int here(struct nh3_c *c) { return c->code_o; }
+#define O(n) gen(c, mpdm_aget(node, n))
 
-        if (mpdm_size(node) == 4) {
-            i = o2(c, OP_JMP, NULL); fix(c, n); O(3); n = i;
-        }
 
-        fix(c, n);
+static mpdm_t prg(struct nh3_c *c)
+/* moves the generated code, constant pool and line table to a program value */
+{
+    mpdm_t r = mpdm_ref(MPDM_A(5));
 
-        break;
+    /* [ code, pool, lines, max_ins, msecs ] */
+    mpdm_aset(r, mpdm_new(MPDM_FREE, c->code, c->code_o), 0);
+    mpdm_aset(r, c->pool, 1);
+    mpdm_aset(r, mpdm_new(MPDM_FREE, c->lines, c->lines_o), 2);
 
-    case N_WHILE:
-        n = here(c); O(1); i = o2(c, OP_JF, NULL);
-        O(2); o2(c, OP_JMP, MPDM_I(n)); fix(c, i); break;
+    c->code = c->lines = NULL;
+    c->code_i = c->code_o = c->lines_i = c->lines_o = 0;
 
-    case N_FOREACH:
-        O(1); o(c, OP_NUL); n = here(c); i = o2(c, OP_ITE, NULL);
-        o(c, OP_TPU); O(2); o(c, OP_TPO);
-        o2(c, OP_JMP, MPDM_I(n)); fix(c, i); break;
+    return mpdm_unrefnd(r);
+}
 
-    case N_OR:
-        O(1); o(c, OP_DUP); o(c, OP_NOT); n = o2(c, OP_JF, NULL);
-        o(c, OP_POP); O(2); fix(c, n); break;
 
-    case N_ORASSIGN:
-        O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET);
-        n = o2(c, OP_JF, NULL);
-        o(c, OP_GET); i = o2(c, OP_JMP, NULL);
-        fix(c, n); O(2); o(c, OP_SET); fix(c, i);
-        break;
+static mpdm_t number(mpdm_t v)
+/* converts a numeric literal to an integer or real constant */
+{
+    wchar_t *s = mpdm_string(v);
+    long long l;
 
-    case N_AND:
-        O(1); o(c, OP_DUP); n = o2(c, OP_JF, NULL);
-        o(c, OP_POP); O(2); fix(c, n); break;
+    if (s[0] == L'0' && (s[1] == L'x' || s[1] == L'X'))
+        l = wcstoll(s + 2, NULL, 16);
+    else
+    if (s[0] == L'0' && (s[1] == L'b' || s[1] == L'B'))
+        l = wcstoll(s + 2, NULL, 2);
+    else
+    if (s[0] == L'0' && OCTDG(s[1]))
+        l = wcstoll(s + 1, NULL, 8);
+    else
+    if (wcspbrk(s, L".eE") == NULL)
+        l = wcstoll(s, NULL, 10);
+    else
+        return MPDM_R(wcstod(s, NULL));
 
-    case N_SUBDEF:
-        n = o2(c, OP_LIT, NULL);
-        i = o2(c, OP_JMP, NULL); fix(c, n);
-        O(1); o(c, OP_ARG); O(2); o(c, OP_TPO); o(c, OP_NUL); o(c, OP_RET); fix(c, i);
-        break;
+    return l >= INT_MIN && l <= INT_MAX ? MPDM_I((int) l) : MPDM_R((double) l);
+}
 
-    case N_IADD: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_ADD); o(c, OP_SET); break;
-    case N_ISUB: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_SUB); o(c, OP_SET); break;
-    case N_IMUL: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_MUL); o(c, OP_SET); break;
-    case N_IDIV: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_DIV); o(c, OP_SET); break;
-    case N_IMOD: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_MOD); o(c, OP_SET); break;
-    case N_IBAND: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_AND); o(c, OP_SET); break;
-    case N_IBOR: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_OR); o(c, OP_SET); break;
-    case N_IXOR: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_XOR); o(c, OP_SET); break;
-    case N_IJOIN: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); O(2); o(c, OP_CAT); o(c, OP_SET); break;
 
-    case N_PINC: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); o2(c, OP_LIT, MPDM_I(1)); o(c, OP_ADD); o(c, OP_SET); break;
-    case N_PDEC: O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET); o2(c, OP_LIT, MPDM_I(1)); o(c, OP_SUB); o(c, OP_SET); break;
+/** constant folding **/
 
-    case N_MAP:
-        o(c, OP_ARR);
-        O(1); o(c, OP_NUL); n = here(c); i = o2(c, OP_ITE, NULL);
-        o(c, OP_TPU);
-        O(2); o2(c, OP_DPN, MPDM_I(4)); o(c, OP_SWP); o(c, OP_APU); o(c, OP_POP);
-        o(c, OP_TPO);
-        o2(c, OP_JMP, MPDM_I(n)); fix(c, i); break;
+int nh3_is_true(mpdm_t v);
 
-    case N_HMAP:
-        o(c, OP_HSH);
-        O(1); o(c, OP_NUL); n = here(c); i = o2(c, OP_ITE, NULL);
-        o(c, OP_TPU);
-        O(2); o2(c, OP_DPN, MPDM_I(4)); o(c, OP_SWP); o(c, OP_DUP);
-        o(c, OP_NUL); o(c, OP_GET); o(c, OP_SWP);
-        o2(c, OP_LIT, MPDM_I(1)); o(c, OP_GET); o(c, OP_SET);
-        o(c, OP_POP);
-        o(c, OP_TPO);
-        o2(c, OP_JMP, MPDM_I(n)); fix(c, i); break;
-    }
+#define NT(n) mpdm_ival(mpdm_aget(n, 0))
+#define IS_CONST(n) (NT(n) == N_LITERAL || NT(n) == N_NUMBER)
 
-    return c->error;
+static mpdm_t cval(mpdm_t node)
+/* returns the value of a constant node */
+{
+    return NT(node) == N_NUMBER ? number(mpdm_aget(node, 1)) : mpdm_aget(node, 1);
 }
 
-/** optimizer **/
-
-#define PO(n) mpdm_ival(mpdm_aget(c->prg, n))
 
-static int opt(struct nh3_c *c)
+static int cnum(mpdm_t v, int *i, double *r)
+/* gets the numeric value of a constant into r; returns 1 (and sets i) if integral */
 {
-    int n = 0;
-
-    while (n < mpdm_size(c->prg)) {
-        /* array initialization */
-        if (PO(n) == OP_ARR && PO(n + 1) == OP_LIT && PO(n + 3) == OP_APU) {
-            mpdm_t v = mpdm_aset(c->prg, MPDM_A(1), n + 3);
-            mpdm_aset(v, mpdm_aget(c->prg, n + 2), 0);
-
-            mpdm_aset(c->prg, MPDM_I(OP_LIT), n + 2);
-            mpdm_aset(c->prg, MPDM_I(OP_NOP), n + 1);
-            mpdm_aset(c->prg, MPDM_I(OP_NOP), n);
-        }
-        /* add element to array literal */
-        if (PO(n) == OP_LIT && PO(n + 2) == OP_LIT && PO(n + 4) == OP_APU) {
-            mpdm_t v = mpdm_aget(c->prg, n + 1);
-            mpdm_push(v, mpdm_aget(c->prg, n + 3));
+    *r = mpdm_rval(v);
 
-            mpdm_aset(c->prg, v,                n + 4);
-            mpdm_aset(c->prg, MPDM_I(OP_LIT),   n + 3);
-            mpdm_aset(c->prg, MPDM_I(OP_NOP),   n + 2);
-            mpdm_aset(c->prg, MPDM_I(OP_NOP),   n + 1);
-            mpdm_aset(c->prg, MPDM_I(OP_NOP),   n + 0);
-        }
-
-        n += opcode_argc[PO(n)] + 1;
+    if (*r >= INT_MIN && *r <= INT_MAX && *r == (double) (int) *r) {
+        *i = (int) *r;
+        return 1;
     }
 
     return 0;
 }
 
-/** virtual machine **/
-
-struct nh3_vm {
-    mpdm_t prg;             /* program */
-    mpdm_t ctxt;            /* context */
-    mpdm_t stack;           /* stack */
-    mpdm_t c_stack;         /* call stack */
-    mpdm_t symtbl;          /* local symbol table */
-    int pc;                 /* program counter */
-    int sp;                 /* stack pointer */
-    int cs;                 /* call stack pointer */
-    int tt;                 /* symbol table top */
-    int mode;               /* running mode */
-    int ins;                /* # of executed instructions */
-    int line;               /* line of source code (debug) */
-    int msecs;              /* max running milliseconds (0, no max) */
-};
-
+/* same as the VM's ARITH() */
+#define CARITH(op) if (k) { l = (long long) i1 op (long long) i2; \
+    return l >= INT_MIN && l <= INT_MAX ? MPDM_I((int) l) : MPDM_R((double) l); } \
+    return MPDM_R(r1 op r2)
 
-static void reset_vm(struct nh3_vm *m, mpdm_t prg)
+static mpdm_t eval(nh3_node_t nt, mpdm_t a, mpdm_t b)
+/* evaluates an operation on constants as the VM would (NULL if not foldable) */
 {
-    mpdm_set(&m->prg,   prg);
+    int i1 = 0, i2 = 0, k;
+    double r1, r2 = 0.0;
+    long long l;
 
-    if (prg != NULL) {
-        mpdm_set(&m->ctxt,  MPDM_A(0));
+    k = cnum(a, &i1, &r1);
 
-        m->stack    = mpdm_push(m->ctxt, MPDM_A(0));
-        m->c_stack  = mpdm_push(m->ctxt, MPDM_A(0));
-        m->symtbl   = mpdm_push(m->ctxt, MPDM_A(0));
+    if (b != NULL)
+        k &= cnum(b, &i2, &r2);
 
-        mpdm_push(m->symtbl, mpdm_root());
-        mpdm_push(m->symtbl, MPDM_H(0));
+    switch (nt) {
+    case N_UMINUS:  return k && i1 != INT_MIN ? MPDM_I(-i1) : MPDM_R(-r1);
+    case N_NOT:     return MPDM_I(!nh3_is_true(a));
+    case N_ADD:     CARITH(+);
+    case N_SUB:     CARITH(-);
+    case N_MUL:     CARITH(*);
+    case N_DIV:     return MPDM_R(r1 / r2);
+    case N_EQ:      return MPDM_I(r1 == r2);
+    case N_NE:      return MPDM_I(r1 != r2);
+    case N_GT:      return MPDM_I(r1 > r2);
+    case N_GE:      return MPDM_I(r1 >= r2);
+    case N_LT:      return MPDM_I(r1 < r2);
+    case N_LE:      return MPDM_I(r1 <= r2);
+    case N_JOIN:    return mpdm_join(a, b);
+    case N_FMT:     return mpdm_fmt(a, b);
+    default:        break;
+    }
 
-        m->pc = m->sp = m->cs = 0;
-        m->tt = mpdm_size(m->symtbl);
-        m->line = m->msecs = 0;
-        m->mode = VM_IDLE;
+    i1 = mpdm_ival(a);
+    i2 = mpdm_ival(b);
+
+    switch (nt) {
+    case N_BINAND:  return MPDM_I(i1 & i2);
+    case N_BINOR:   return MPDM_I(i1 | i2);
+    case N_XOR:     return MPDM_I(i1 ^ i2);
+    /* leave the traps and undefined behaviour to run time */
+    case N_MOD:     return i2 == 0 || i2 == -1 ? NULL : MPDM_I(i1 % i2);
+    case N_SHL:     return i2 < 0 || i2 > 31 ? NULL : MPDM_I(i1 << i2);
+    case N_SHR:     return i2 < 0 || i2 > 31 ? NULL : MPDM_I(i1 >> i2);
+    default:        return NULL;
     }
-    else
-        mpdm_set(&m->ctxt, NULL);
 }
 
 
-static void vm_error(struct nh3_vm *m, mpdm_t s1, mpdm_t s2) 
+static mpdm_t fold(mpdm_t node)
+/* folds the operations on constants of a tree of nodes */
 {
-    mpdm_t t;
+    int n;
+    mpdm_t v, a, b, r = NULL;
+    nh3_node_t nt = NT(node);
 
-    mpdm_ref(s1);
-    mpdm_ref(s2);
+    if (nt == N_LITERAL || nt == N_NUMBER)
+        return node;
 
-    m->mode = VM_ERROR;
+    for (n = 1; n < mpdm_size(node); n++) {
+        if (MPDM_IS_ARRAY(v = mpdm_aget(node, n)))
+            mpdm_aset(node, fold(v), n);
+    }
 
-    t = mpdm_fmt(MPDM_LS(L":%d: error: %s"), MPDM_I(m->line));
-    t = mpdm_fmt(t, s1);
+    for (n = 1; n < mpdm_size(node); n++) {
+        if (!MPDM_IS_ARRAY(v = mpdm_aget(node, n)) || !IS_CONST(v))
+            return node;
+    }
 
-    s_error(t, s2); 
+    switch (nt) {
+    case N_ARRAY:
+        r = MPDM_A(0);
 
-    mpdm_unref(s2);
-    mpdm_unref(s1);
-}
+        for (n = 1; n < mpdm_size(node); n++)
+            mpdm_push(r, cval(mpdm_aget(node, n)));
 
-static mpdm_t PUSH(struct nh3_vm *m, mpdm_t v) { return mpdm_aset(m->stack, v, m->sp++); }
-static mpdm_t POP(struct nh3_vm *m) { return mpdm_aget(m->stack, --m->sp); }
-static mpdm_t TOS(struct nh3_vm *m) { return mpdm_aget(m->stack, m->sp - 1); }
-static mpdm_t PC(struct nh3_vm *m) { return mpdm_aget(m->prg, m->pc++); }
+        break;
 
-static mpdm_t GET(struct nh3_vm *m, mpdm_t h, mpdm_t k)
-{
-    mpdm_t r = NULL;
+    case N_HASH:
+        r = MPDM_H(0);
 
-    if (MPDM_IS_HASH(h))
-        r = mpdm_hget(h, k);
-    else
-    if (MPDM_IS_ARRAY(h))
-        r = mpdm_aget(h, mpdm_ival(k)); 
-    else
-    if (MPDM_IS_STRING(h))
-        r = mpdm_slice(h, mpdm_ival(k), 1);
-    else
-        vm_error(m, MPDM_LS(L"bad holder in GET for key "), k);
+        for (n = 1; n < mpdm_size(node); n += 2)
+            mpdm_hset(r, cval(mpdm_aget(node, n)), cval(mpdm_aget(node, n + 1)));
 
-    return r;
-}
+        break;
 
-static mpdm_t SET(struct nh3_vm *m, mpdm_t h, mpdm_t k, mpdm_t v)
-{
-    mpdm_t r = NULL;
+    case N_UMINUS: case N_NOT:
+    case N_MOD: case N_DIV: case N_MUL: case N_SUB: case N_ADD:
+    case N_EQ: case N_NE: case N_GT: case N_GE: case N_LT: case N_LE:
+    case N_BINAND: case N_BINOR: case N_XOR: case N_SHL: case N_SHR:
+    case N_JOIN: case N_FMT:
+        a = RF(cval(mpdm_aget(node, 1)));
+        b = RF(mpdm_size(node) > 2 ? cval(mpdm_aget(node, 2)) : NULL);
 
-    if (MPDM_IS_HASH(h))
-        r = mpdm_hset(h, k, v);
-    else
-    if (MPDM_IS_ARRAY(h))
-        r = mpdm_aset(h, v, mpdm_ival(k)); 
-    else
-        vm_error(m, MPDM_LS(L"bad holder in SET for key "), k);
+        r = eval(nt, a, b);
 
-    return r;
-}
+        UF(b);
+        UF(a);
+        break;
 
+    default:
+        break;
+    }
 
-wchar_t *nh3_type(mpdm_t v)
-{
-    wchar_t *t = L"SCALAR";
+    return r == NULL ? node : node1(N_LITERAL, r);
+}
 
-    if (MPDM_IS_FILE(v))
-        t = L"IO";
-    else
-    if (MPDM_IS_HASH(v))
-        t = L"HASH";
-    else
-    if (MPDM_IS_ARRAY(v))
-        t = L"ARRAY";
 
-    return t;
-}
+/** local variables **/
 
+/*
+    Local variables (those created with var and subroutine arguments)
+    live in numbered slots of the subroutine frame instead of in the
+    symbol table, unless their name is used, but not declared, inside
+    another subroutine; as scope is dynamic, those must still be found
+    by walking the symbol table. Names inside a member context (the
+    right side of a dot) are always resolved dynamically.
+*/
 
-static mpdm_t TBL(struct nh3_vm *m)
+static void scan(struct nh3_c *c, mpdm_t node, mpdm_t d, mpdm_t r, int member)
+/* collects the names declared (d) and referenced (r) in a subroutine */
 {
     int n;
-    mpdm_t s = mpdm_ref(POP(m));
+    mpdm_t v, w, k, t;
+
+    switch (NT(node)) {
+    case N_LITERAL:
+    case N_NUMBER:
+        break;
+
+    case N_SYMID:
+        if (!member)
+            mpdm_hset(r, mpdm_aget(node, 1), MPDM_I(1));
+        break;
+
+    case N_VAR:
+        if (!member)
+            mpdm_hset(d, mpdm_aget(mpdm_aget(node, 1), 1), MPDM_I(1));
+        break;
+
+    case N_SYMVAL:
+        scan(c, mpdm_aget(node, 1), d, r, member);
+        break;
+
+    case N_FUNCAL:
+        scan(c, mpdm_aget(node, 1), d, r, 0);
+        scan(c, mpdm_aget(node, 2), d, r, member);
+        break;
+
+    case N_PARTOF:
+        scan(c, mpdm_aget(node, 1), d, r, 0);
+        scan(c, mpdm_aget(node, 2), d, r, 1);
+        break;
+
+    case N_FOREACH:
+    case N_MAP:
+    case N_HMAP:
+        /* key and value are created by the iterator */
+        w = mpdm_ref(MPDM_H(0));
+
+        scan(c, mpdm_aget(node, 1), d, r, 0);
+        scan(c, mpdm_aget(node, 2), d, w, 0);
+
+        mpdm_hdel(w, MPDM_LS(L"key"));
+        mpdm_hdel(w, MPDM_LS(L"value"));
+
+        n = 0;
+        while (mpdm_iterator(w, &n, &k, &t))
+            mpdm_hset(r, k, t);
+
+        mpdm_unref(w);
+        break;
+
+    case N_SUBDEF:
+        /* names not declared inside a subroutine must stay dynamic */
+        v = mpdm_ref(MPDM_H(0));
+        w = mpdm_ref(MPDM_H(0));
+        t = mpdm_aget(mpdm_aget(node, 1), 1);
+
+        for (n = 0; n < mpdm_size(t); n++)
+            mpdm_hset(v, mpdm_aget(t, n), MPDM_I(1));
+
+        scan(c, mpdm_aget(node, 2), v, w, 0);
+
+        n = 0;
+        while (mpdm_iterator(w, &n, &k, &t)) {
+            if (!mpdm_exists(v, k))
+                mpdm_hset(c->dyn, k, MPDM_I(1));
+        }
+
+        mpdm_unref(w);
+        mpdm_unref(v);
+        break;
+
+    default:
+        for (n = 1; n < mpdm_size(node); n++) {
+            if (MPDM_IS_ARRAY(v = mpdm_aget(node, n)))
+                scan(c, v, d, r, 0);
+        }
+
+        break;
+    }
+}
+
+
+static int dynvar(struct nh3_c *c, mpdm_t node)
+/* returns true if node declares a dynamic local (outside subroutines) */
+{
+    int n;
+    mpdm_t v;
+
+    switch (NT(node)) {
+    case N_LITERAL:
+    case N_SUBDEF:
+        return 0;
+
+    case N_VAR:
+        return mpdm_exists(c->dyn, mpdm_aget(mpdm_aget(node, 1), 1));
+
+    default:
+        for (n = 1; n < mpdm_size(node); n++) {
+            if (MPDM_IS_ARRAY(v = mpdm_aget(node, n)) && dynvar(c, v))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int yields(mpdm_t node)
+/* returns true if node has yield statements (outside subroutines) */
+{
+    int n;
+    mpdm_t v;
+
+    switch (NT(node)) {
+    case N_LITERAL:
+    case N_SUBDEF:
+        return 0;
+
+    case N_YIELD:
+        return 1;
+
+    default:
+        for (n = 1; n < mpdm_size(node); n++) {
+            if (MPDM_IS_ARRAY(v = mpdm_aget(node, n)) && yields(v))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int scope_in(struct nh3_c *c, mpdm_t body)
+/* opens an iterator scope; returns the frame slot of key (value
+   takes the next one), or -1 if they live in an iterator hash */
+{
+    mpdm_t s = mpdm_push(c->scope, MPDM_H(0));
+    int k = -1;
+
+    /* the iterator hash is only needed if key or value are resolved
+       dynamically or the body declares dynamic locals in its scope */
+    if (!mpdm_exists(c->dyn, MPDM_LS(L"key")) &&
+        !mpdm_exists(c->dyn, MPDM_LS(L"value")) && !dynvar(c, body)) {
+        k = c->slots;
+        c->slots += 2;
+    }
+
+    mpdm_hset_s(s, L"key",      MPDM_I(k));
+    mpdm_hset_s(s, L"value",    MPDM_I(k < 0 ? -1 : k + 1));
+
+    return k;
+}
+
+static void scope_out(struct nh3_c *c) { mpdm_void(mpdm_pop(c->scope)); }
+
+
+static int slot(struct nh3_c *c, mpdm_t node)
+/* returns the frame slot of a symbol, or -1 if it's dynamic */
+{
+    int n;
+    mpdm_t k, s;
+
+    if (!c->member && NT(node) == N_SYMID) {
+        k = mpdm_aget(node, 1);
+
+        for (n = mpdm_size(c->scope) - 1; n >= 0; n--) {
+            if (mpdm_exists(s = mpdm_aget(c->scope, n), k))
+                return mpdm_ival(mpdm_hget(s, k));
+        }
+    }
+
+    return -1;
+}
+
+
+static int decl(struct nh3_c *c, mpdm_t k)
+/* declares a local in the current scope and returns its slot */
+{
+    mpdm_t s = mpdm_aget(c->scope, mpdm_size(c->scope) - 1);
+
+    if (mpdm_exists(c->dyn, k))
+        return -1;
+
+    if (!mpdm_exists(s, k))
+        mpdm_hset(s, k, MPDM_I(c->slots++));
+
+    return mpdm_ival(mpdm_hget(s, k));
+}
+
+
+static int gen(struct nh3_c *c, mpdm_t node);
+
+static int pure(mpdm_t node)
+/* returns true if evaluating node cannot have side effects */
+{
+    int n;
+    mpdm_t v;
+    nh3_node_t nt = NT(node);
+
+    if (nt == N_LITERAL || nt == N_NUMBER)
+        return 1;
+
+    if (nt != N_SYMID && nt != N_SYMVAL && nt != N_SUBSCR && nt != N_PARTOF &&
+        !(nt >= N_UMINUS && nt <= N_JOIN) && nt != N_FMT)
+        return 0;
+
+    for (n = 1; n < mpdm_size(node); n++) {
+        if (MPDM_IS_ARRAY(v = mpdm_aget(node, n)) && !pure(v))
+            return 0;
+    }
+
+    return 1;
+}
+
+
+static void iop(struct nh3_c *c, mpdm_t node, nh3_op_t op)
+/* generates an in-place operation (+=, ++, etc.) */
+{
+    int i = slot(c, mpdm_aget(node, 1));
+
+    /* no second operand: ++ or -- */
+    int inc = mpdm_size(node) == 2;
+
+    /* the fused opcodes evaluate the operand before reading the
+       variable, so they are only used if that cannot change it */
+    if (inc || pure(mpdm_aget(node, 2))) {
+        if (i >= 0 && op == OP_ADD) {
+            if (inc) o2(c, OP_INC, i); else { O(2); o2(c, OP_ADL, i); }
+            return;
+        }
+
+        if (i >= 0 && op == OP_SUB) {
+            if (inc) o2(c, OP_DEC, i); else { O(2); o2(c, OP_SBL, i); }
+            return;
+        }
+
+        if (i < 0) {
+            O(1);
+            if (inc) lit(c, MPDM_I(1)); else O(2);
+            o2(c, OP_GMS, op);
+            return;
+        }
+    }
+
+    if (i >= 0)
+        o2(c, OP_LDL, i);
+    else {
+        O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET);
+    }
+
+    if (inc)
+        lit(c, MPDM_I(1));
+    else
+        O(2);
+
+    o(c, op);
+
+    if (i >= 0)
+        o2(c, OP_STL, i);
+    else
+        o(c, OP_SET);
+}
+
+
+static int iter_in(struct nh3_c *c, mpdm_t node, int *n)
+/* opens a loop over the set in node, with node[2] as body; returns
+   the address of the exit jump to fix and sets n to the loop start */
+{
+    int i, k;
+
+    gen(c, mpdm_aget(node, 1));
+
+    if ((k = scope_in(c, mpdm_aget(node, 2))) >= 0) {
+        /* key and value are stored in their slots */
+        lit(c, MPDM_I(0));
+        *n = here(c);
+        i = o2(c, OP_ITS, 0);
+        emit(c, k);
+    }
+    else {
+        o(c, OP_NUL);
+        *n = here(c);
+        i = o2(c, OP_ITE, 0);
+        o(c, OP_TPU);
+    }
+
+    return i;
+}
+
+
+static int iter_h(struct nh3_c *c)
+/* returns true if the innermost iterator has an iterator hash */
+{
+    mpdm_t s = mpdm_aget(c->scope, mpdm_size(c->scope) - 1);
+
+    return mpdm_ival(mpdm_hget_s(s, L"key")) < 0;
+}
+
+
+static void iter_out(struct nh3_c *c, int n, int i)
+/* closes a loop opened by iter_in() */
+{
+    if (iter_h(c))
+        o(c, OP_TPO);
+
+    scope_out(c);
+    o2(c, OP_JMP, n);
+    fix(c, i);
+}
+
+
+static void cond(struct nh3_c *c, mpdm_t node, mpdm_t f)
+/* generates a condition, adding to f the jumps to fix to its false branch */
+{
+    int n;
+
+    switch (NT(node)) {
+    /* comparisons are fused with the branch */
+    case N_EQ: n = OP_JEQ; break;
+    case N_NE: n = OP_JNE; break;
+    case N_GT: n = OP_JGT; break;
+    case N_GE: n = OP_JGE; break;
+    case N_LT: n = OP_JLT; break;
+    case N_LE: n = OP_JLE; break;
+
+    case N_AND:
+        cond(c, mpdm_aget(node, 1), f);
+        cond(c, mpdm_aget(node, 2), f);
+        return;
+
+    case N_OR:
+        gen(c, mpdm_aget(node, 1));
+        n = o2(c, OP_JT, 0);
+        cond(c, mpdm_aget(node, 2), f);
+        fix(c, n);
+        return;
+
+    default:
+        gen(c, node);
+        mpdm_push(f, MPDM_I(o2(c, OP_JF, 0)));
+        return;
+    }
+
+    gen(c, mpdm_aget(node, 1));
+    gen(c, mpdm_aget(node, 2));
+    mpdm_push(f, MPDM_I(o2(c, n, 0)));
+}
+
+
+static void fixall(struct nh3_c *c, mpdm_t f)
+/* fixes a list of jumps to here */
+{
+    int n;
+
+    for (n = 0; n < mpdm_size(f); n++)
+        fix(c, mpdm_ival(mpdm_aget(f, n)));
+}
+
+
+static void frame(struct nh3_c *c, mpdm_t args, mpdm_t body)
+/* generates a subroutine body in a new frame */
+{
+    mpdm_t scope = mpdm_ref(c->scope);
+    int slots = c->slots;
+    int tlt = c->tlt;
+    int n, i, d = 0;
+    mpdm_t a, k;
+
+    c->scope = mpdm_ref(MPDM_A(0));
+    c->slots = 0;
+    c->tlt   = 0;
+    mpdm_push(c->scope, MPDM_H(0));
+
+    /* subroutines that yield are generators (the program is not) */
+    if (yields(body)) {
+        if (args)
+            o(c, OP_GEN);
+        else
+            c_error(c);
+    }
+
+    /* the arguments take the first frame slots; the names of those
+       that must be resolved dynamically are also given */
+    a = mpdm_ref(MPDM_A(0));
+
+    for (n = 0; args && n < mpdm_size(args); n++) {
+        k = mpdm_aget(args, n);
+
+        if (mpdm_exists(c->dyn, k)) {
+            mpdm_push(a, k);
+            d = 1;
+        }
+        else {
+            mpdm_push(a, NULL);
+            mpdm_hset(mpdm_aget(c->scope, 0), k, MPDM_I(n));
+        }
+
+        c->slots++;
+    }
+
+    if (args) {
+        lit(c, a);
+        i = o2(c, OP_ARG, 0);
+    }
+    else
+        i = o2(c, OP_ENT, 0);
+
+    gen(c, body);
+
+    c->code[i] = c->slots;
+
+    /* no names to create: the argument names are not needed
+       and the frame can share an empty symbol table */
+    if (args && !d && !c->tlt) {
+        c->code[i - 3] = OP_NOP;
+        c->code[i - 2] = OP_FRM;
+        c->code[i - 1] = c->slots;
+        c->code[i]     = mpdm_size(args);
+    }
+
+    mpdm_unref(a);
+    mpdm_unref(c->scope);
+    c->scope = scope;
+    c->slots = slots;
+    c->tlt   = tlt;
+    mpdm_unrefnd(scope);
+}
+
+
+static int gen(struct nh3_c *c, mpdm_t node)
+/* generates nh3 VM code from a tree of nodes */
+{
+    int n, i;
+    mpdm_t w;
+
+    nh3_node_t nt = mpdm_ival(mpdm_aget(node, 0));
+    int mb = c->member;
+
+    /* only symbol names (or calls to them) can be members */
+    if (nt != N_SYMID && nt != N_SYMVAL && nt != N_VAR && nt != N_FUNCAL)
+        c->member = 0;
+
+    switch (nt) {
+    case N_NOP:     break;
+    case N_EOP:     o(c, OP_RET); break;
+    case N_NULL:    o(c, OP_NUL); break;
+    case N_SYMID:   lit(c, mpdm_aget(node, 1)); o2(c, OP_TBL, c->sites++); break;
+    case N_LITERAL: lit(c, mpdm_aget(node, 1)); break;
+    case N_NUMBER:  lit(c, number(mpdm_aget(node, 1))); break;
+    case N_SEQ:     O(1); O(2); break;
+    case N_ADD:     O(1); O(2); o(c, OP_ADD); break;
+    case N_SUB:     O(1); O(2); o(c, OP_SUB); break;
+    case N_MUL:     O(1); O(2); o(c, OP_MUL); break;
+    case N_DIV:     O(1); O(2); o(c, OP_DIV); break;
+    case N_MOD:     O(1); O(2); o(c, OP_MOD); break;
+    case N_UMINUS:  O(1); lit(c, MPDM_I(-1)); o(c, OP_MUL); break;
+    case N_NOT:     O(1); o(c, OP_NOT); break;
+    case N_EQ:      O(1); O(2); o(c, OP_EQ); break;
+    case N_NE:      O(1); O(2); o(c, OP_EQ); o(c, OP_NOT); break;
+    case N_GT:      O(1); O(2); o(c, OP_GT); break;
+    case N_GE:      O(1); O(2); o(c, OP_GE); break;
+    case N_LT:      O(1); O(2); o(c, OP_LT); break;
+    case N_LE:      O(1); O(2); o(c, OP_LE); break;
+    case N_PARTOF:  O(1); o(c, OP_TPU); c->member = 1; O(2); c->member = 0; o(c, OP_TPO); break;
+    case N_THIS:    o(c, OP_THS); break;
+    case N_SUBSCR:  O(1); O(2); break;
+    case N_VOID:    O(1); o(c, OP_POP); break;
+    case N_VAR:     o(c, OP_TLT); O(1); c->tlt = 1; break;
+    case N_RETURN:  c->tail = NT(mpdm_aget(node, 1)) == N_FUNCAL;
+                    O(1); o(c, OP_TPO); o(c, OP_RET); break;
+    case N_YIELD:   O(1); o(c, OP_YLD); break;
+    case N_BINAND:  O(1); O(2); o(c, OP_AND); break;
+    case N_BINOR:   O(1); O(2); o(c, OP_OR); break;
+    case N_XOR:     O(1); O(2); o(c, OP_XOR); break;
+    case N_SHL:     O(1); O(2); o(c, OP_SHL); break;
+    case N_SHR:     O(1); O(2); o(c, OP_SHR); break;
+    case N_JOIN:    O(1); O(2); o(c, OP_CAT); break;
+    case N_FMT:     O(1); O(2); o(c, OP_FMT); break;
+    case N_LINEINFO: line(c, mpdm_ival(mpdm_aget(node, 2))); O(1); break;
+    case N_SPAWN:   O(1); o(c, OP_FRK); break;
+
+    case N_ASSIGN:
+        w = mpdm_aget(node, 1);
+
+        if (!c->member && NT(w) == N_VAR &&
+            (i = decl(c, mpdm_aget(mpdm_aget(w, 1), 1))) >= 0) {
+            O(2); o2(c, OP_STL, i);
+        }
+        else
+        if ((i = slot(c, w)) >= 0) {
+            O(2); o2(c, OP_STL, i);
+        }
+        else {
+            O(1); O(2); o(c, OP_SET);
+        }
+
+        break;
+
+    case N_SYMVAL:
+        w = mpdm_aget(node, 1);
+
+        if ((i = slot(c, w)) >= 0)
+            o2(c, OP_LDL, i);
+        else
+        if (NT(w) == N_SUBSCR && NT(mpdm_aget(w, 1)) == N_SYMVAL &&
+            (i = slot(c, mpdm_aget(mpdm_aget(w, 1), 1))) >= 0 && pure(mpdm_aget(w, 2))) {
+            /* element of a local */
+            gen(c, mpdm_aget(w, 2));
+            o2(c, OP_GTL, i);
+        }
+        else {
+            O(1); o(c, OP_GET);
+        }
+
+        break;
+
+    case N_FUNCAL:
+        w = mpdm_aget(node, 1);
+        i = c->tail;
+        c->tail = c->member = 0;
+
+        /* the arguments are passed on the stack */
+        if (NT(w) == N_ARRAY) {
+            for (n = 1; n < mpdm_size(w); n++)
+                gen(c, mpdm_aget(w, n));
+            n--;
+        }
+        else
+        if (NT(w) == N_LITERAL && MPDM_IS_ARRAY(mpdm_aget(w, 1))) {
+            w = mpdm_aget(w, 1);
+
+            for (n = 0; n < mpdm_size(w); n++)
+                lit(c, mpdm_aget(w, n));
+        }
+        else {
+            /* unless given as an array */
+            O(1);
+            n = -1;
+        }
+
+        c->member = mb;
+        O(2);
+
+        if (n >= 0)
+            o2(c, i ? OP_TCL : OP_CLN, n);
+        else
+            o(c, OP_CAL);
+
+        break;
+
+    case N_ARRAY:
+        o(c, OP_ARR);
+        for (n = 1; n < mpdm_size(node); n++) {
+            O(n);
+            o(c, OP_APU);
+        }
+        break;
+
+    case N_HASH:
+        o(c, OP_HSH);
+        for (n = 1; n < mpdm_size(node); n += 2) {
+            O(n);
+            O(n + 1);
+            o(c, OP_STI);
+        }
+        break;
+
+    case N_IF:
+        w = RF(MPDM_A(0));
+        cond(c, mpdm_aget(node, 1), w); O(2);
+
+        if (mpdm_size(node) == 4) {
+            i = o2(c, OP_JMP, 0); fixall(c, w); O(3); fix(c, i);
+        }
+        else
+            fixall(c, w);
+
+        UF(w);
+        break;
+
+    case N_WHILE:
+        w = RF(MPDM_A(0));
+        n = here(c); cond(c, mpdm_aget(node, 1), w);
+        O(2); o2(c, OP_JMP, n); fixall(c, w);
+        UF(w);
+        break;
+
+    case N_FOREACH:
+        i = iter_in(c, node, &n); O(2); iter_out(c, n, i); break;
+
+    case N_OR:
+        O(1); o(c, OP_DUP); o(c, OP_NOT); n = o2(c, OP_JF, 0);
+        o(c, OP_POP); O(2); fix(c, n); break;
+
+    case N_ORASSIGN:
+        if ((i = slot(c, mpdm_aget(node, 1))) >= 0) {
+            o2(c, OP_LDL, i); o(c, OP_DUP); o(c, OP_NOT); n = o2(c, OP_JF, 0);
+            o(c, OP_POP); O(2); o2(c, OP_STL, i); fix(c, n);
+        }
+        else {
+            O(1); o(c, OP_DP2); o(c, OP_DP2); o(c, OP_GET);
+            n = o2(c, OP_JF, 0);
+            o(c, OP_GET); i = o2(c, OP_JMP, 0);
+            fix(c, n); O(2); o(c, OP_SET); fix(c, i);
+        }
+        break;
+
+    case N_AND:
+        O(1); o(c, OP_DUP); n = o2(c, OP_JF, 0);
+        o(c, OP_POP); O(2); fix(c, n); break;
+
+    case N_SUBDEF:
+        n = lit(c, NULL);
+        i = o2(c, OP_JMP, 0); fixlit(c, n);
+        frame(c, mpdm_aget(mpdm_aget(node, 1), 1), mpdm_aget(node, 2));
+        o(c, OP_TPO); o(c, OP_NUL); o(c, OP_RET); fix(c, i);
+        break;
+
+    case N_IADD:  iop(c, node, OP_ADD); break;
+    case N_ISUB:  iop(c, node, OP_SUB); break;
+    case N_IMUL:  iop(c, node, OP_MUL); break;
+    case N_IDIV:  iop(c, node, OP_DIV); break;
+    case N_IMOD:  iop(c, node, OP_MOD); break;
+    case N_IBAND: iop(c, node, OP_AND); break;
+    case N_IBOR:  iop(c, node, OP_OR);  break;
+    case N_IXOR:  iop(c, node, OP_XOR); break;
+    case N_IJOIN: iop(c, node, OP_CAT); break;
+
+    case N_PINC:  iop(c, node, OP_ADD); break;
+    case N_PDEC:  iop(c, node, OP_SUB); break;
+
+    case N_MAP:
+        o(c, OP_ARR);
+        i = iter_in(c, node, &n);
+        O(2); o2(c, OP_DPN, 4); o(c, OP_SWP); o(c, OP_APU); o(c, OP_POP);
+        iter_out(c, n, i); break;
+
+    case N_HMAP:
+        o(c, OP_HSH);
+        i = iter_in(c, node, &n);
+        O(2); o2(c, OP_DPN, 4); o(c, OP_SWP); o(c, OP_DUP);
+        o(c, OP_NUL); o(c, OP_GET); o(c, OP_SWP);
+        lit(c, MPDM_I(1)); o(c, OP_GET); o(c, OP_SET);
+        o(c, OP_POP);
+        iter_out(c, n, i); break;
+    }
+
+    c->member = mb;
+
+    return c->error;
+}
+
+/** optimizer **/
+
+#define PO(n) ((n) < c->code_o ? c->code[n] : OP_EOP)
+#define PL(n) mpdm_aget(c->pool, c->code[n])
+#define IS_JUMP(o) ((o) == OP_JMP || (o) == OP_JF || (o) == OP_JT || (o) == OP_ITE || (o) == OP_ITS || \
+    ((o) >= OP_JEQ && (o) <= OP_JLE))
+#define IS_NUM(v) ((v) != NULL && ((v)->flags & (MPDM_IVAL | MPDM_RVAL)))
+
+static int nxt(struct nh3_c *c, int n)
+/* returns the next non-NOP instruction after n */
+{
+    n += opcode_argc[PO(n)] + 1;
+
+    while (PO(n) == OP_NOP && n < c->code_o)
+        n++;
+
+    return n;
+}
+
+/* peephole rules: i holds the addresses of the matched instructions */
+
+static int r_arrinit(struct nh3_c *c, int *i)
+/* ARR; LIT v; APU -> LIT [v] */
+{
+    mpdm_t v = mpdm_push(c->pool, MPDM_A(1));
+    mpdm_aset(v, PL(i[1] + 1), 0);
+
+    c->code[i[1] + 1] = mpdm_size(c->pool) - 1;
+    c->code[i[0]] = c->code[i[2]] = OP_NOP;
+
+    return 1;
+}
+
+static int r_arrpush(struct nh3_c *c, int *i)
+/* LIT [...]; LIT v; APU -> LIT [..., v] */
+{
+    if (!MPDM_IS_ARRAY(PL(i[0] + 1)) || MPDM_IS_HASH(PL(i[0] + 1)))
+        return 0;
+
+    mpdm_push(PL(i[0] + 1), PL(i[1] + 1));
+    c->code[i[1]] = c->code[i[1] + 1] = c->code[i[2]] = OP_NOP;
+
+    return 1;
+}
+
+static int r_neg(struct nh3_c *c, int *i)
+/* LIT -1; MUL -> NEG */
+{
+    if (!IS_NUM(PL(i[0] + 1)) || mpdm_rval(PL(i[0] + 1)) != -1.0)
+        return 0;
+
+    c->code[i[0]] = c->code[i[0] + 1] = OP_NOP;
+    c->code[i[1]] = OP_NEG;
+
+    return 1;
+}
+
+static int r_neglit(struct nh3_c *c, int *i)
+/* LIT n; NEG -> LIT -n */
+{
+    mpdm_t v = PL(i[0] + 1);
+
+    if (!IS_NUM(v))
+        return 0;
+
+    if ((v->flags & MPDM_RVAL) || mpdm_ival(v) == INT_MIN)
+        v = MPDM_R(-mpdm_rval(v));
+    else
+        v = MPDM_I(-mpdm_ival(v));
+
+    mpdm_push(c->pool, v);
+    c->code[i[0] + 1] = mpdm_size(c->pool) - 1;
+    c->code[i[1]] = OP_NOP;
+
+    return 1;
+}
+
+static int r_ne(struct nh3_c *c, int *i)
+/* EQ; NOT -> NE */
+{
+    c->code[i[0]] = OP_NE;
+    c->code[i[1]] = OP_NOP;
+
+    return 1;
+}
+
+static int r_jt(struct nh3_c *c, int *i)
+/* NOT; JF x -> JT x */
+{
+    c->code[i[0]] = OP_NOP;
+    c->code[i[1]] = OP_JT;
+
+    return 1;
+}
+
+static int r_duppop(struct nh3_c *c, int *i)
+/* DUP; POP -> (nothing) */
+{
+    c->code[i[0]] = c->code[i[1]] = OP_NOP;
+
+    return 1;
+}
+
+static struct {
+    nh3_op_t pat[4];                        /* instructions (OP_EOP ended) */
+    int (*rule)(struct nh3_c *c, int *i);   /* rewriter */
+} peephole[] = {
+    { { OP_ARR, OP_LIT, OP_APU, OP_EOP },   r_arrinit },
+    { { OP_LIT, OP_LIT, OP_APU, OP_EOP },   r_arrpush },
+    { { OP_LIT, OP_MUL, OP_EOP },           r_neg },
+    { { OP_LIT, OP_NEG, OP_EOP },           r_neglit },
+    { { OP_EQ,  OP_NOT, OP_EOP },           r_ne },
+    { { OP_NOT, OP_JF,  OP_EOP },           r_jt },
+    { { OP_DUP, OP_POP, OP_EOP },           r_duppop },
+    { { OP_EOP }, NULL }
+};
+
+
+static char *targets(struct nh3_c *c)
+/* returns a map of the addresses that are jump targets */
+{
+    char *t = calloc(c->code_o + 1, 1);
+    int n;
+
+    for (n = 0; n < c->code_o; n += opcode_argc[c->code[n]] + 1) {
+        if (IS_JUMP(c->code[n]))
+            t[c->code[n + 1]] = 1;
+    }
+
+    /* subroutine addresses */
+    for (n = 0; n < mpdm_size(c->subs); n++)
+        t[mpdm_ival(mpdm_aget(c->pool, mpdm_ival(mpdm_aget(c->subs, n))))] = 1;
+
+    return t;
+}
+
+
+static int match(struct nh3_c *c, int n, char *t, int r, int *i)
+/* matches a peephole rule at n, filling i */
+{
+    int m, p;
+
+    for (m = 0; peephole[r].pat[m] != OP_EOP; m++) {
+        if (PO(n) != peephole[r].pat[m])
+            return 0;
+
+        i[m] = n;
+        p = n;
+        n = nxt(c, n);
+
+        /* cannot match across a jump target */
+        if (peephole[r].pat[m + 1] != OP_EOP) {
+            while (++p <= n) {
+                if (t[p])
+                    return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+
+static int thread(struct nh3_c *c)
+/* threads jumps to jumps and drops jumps to the next instruction */
+{
+    int n, m, d, r = 0;
+
+    for (n = 0; n < c->code_o; n += opcode_argc[c->code[n]] + 1) {
+        if (!IS_JUMP(c->code[n]))
+            continue;
+
+        /* follow chains of unconditional jumps (limited, for loops) */
+        for (d = 0; d < 16; d++) {
+            m = c->code[n + 1];
+
+            while (PO(m) == OP_NOP && m < c->code_o)
+                m++;
+
+            if (PO(m) != OP_JMP || c->code[m + 1] == c->code[n + 1])
+                break;
+
+            c->code[n + 1] = c->code[m + 1];
+            r = 1;
+        }
+
+        if (c->code[n] == OP_JMP && c->code[n + 1] == nxt(c, n)) {
+            c->code[n] = c->code[n + 1] = OP_NOP;
+            r = 1;
+        }
+    }
+
+    return r;
+}
+
+
+static void compact(struct nh3_c *c)
+/* deletes the NOPs, relocating the jumps and subroutine addresses */
+{
+    int *map = malloc((c->code_o + 1) * sizeof(int));
+    int n, m, o = 0;
+    nh3_op_t op;
+
+    /* new addresses (NOPs go to the next instruction) */
+    for (n = 0; n < c->code_o; n++) {
+        map[n] = o;
+
+        if (c->code[n] != OP_NOP) {
+            for (m = opcode_argc[c->code[n]]; m; m--)
+                map[++n] = ++o;
+            o++;
+        }
+    }
+
+    map[c->code_o] = o;
+
+    for (n = 0; n < c->code_o; n += opcode_argc[op] + 1) {
+        op = c->code[n];
+
+        if (op == OP_NOP)
+            continue;
+
+        c->code[map[n]] = op;
+
+        for (m = 1; m <= opcode_argc[op]; m++)
+            c->code[map[n] + m] = c->code[n + m];
+
+        if (IS_JUMP(op))
+            c->code[map[n] + 1] = map[c->code[map[n] + 1]];
+    }
+
+    for (n = 0; n < mpdm_size(c->subs); n++) {
+        m = mpdm_ival(mpdm_aget(c->subs, n));
+        mpdm_aset(c->pool, MPDM_I(map[mpdm_ival(mpdm_aget(c->pool, m))]), m);
+    }
+
+    /* line table (the last of the lines left at the same pc wins) */
+    for (n = m = 0; n < c->lines_o; n += 2) {
+        if (m && c->lines[m - 2] == map[c->lines[n]])
+            m -= 2;
+
+        c->lines[m++] = map[c->lines[n]];
+        c->lines[m++] = c->lines[n + 1];
+    }
+
+    c->lines_o = m;
+
+    c->code_o = o;
+
+    free(map);
+}
+
+
+static int opt(struct nh3_c *c)
+{
+    int n, r, changed;
+    int i[4];
+    char *t;
+
+    do {
+        changed = 0;
+        t = targets(c);
+
+        for (n = 0; n < c->code_o; n += opcode_argc[PO(n)] + 1) {
+            for (r = 0; peephole[r].rule != NULL; r++) {
+                if (match(c, n, t, r, i) && peephole[r].rule(c, i)) {
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+
+        free(t);
+
+        changed |= thread(c);
+        compact(c);
+    } while (changed);
+
+    return 0;
+}
+
+/** virtual machine **/
+
+/* stack value types */
+enum {
+    V_INT, V_REAL, V_VAL, V_LIT
+};
+
+struct nh3_val {
+    int type;               /* value type */
+    union {
+        mpdm_t v;           /* V_VAL: an mpdm value; V_LIT: a shared literal */
+        int i;              /* V_INT: an immediate integer */
+        double r;           /* V_REAL: an immediate real */
+    } u;
+};
+
+/* inline cache for a symbol lookup site */
+struct nh3_ic {
+    mpdm_t l;               /* table where the symbol was found */
+    int n;                  /* its symbol table level (-1, type table) */
+    int tt;                 /* symbol table top at the time */
+    int stamp;              /* symbol stamp at the time */
+    wchar_t *type;          /* type of the top level (for type tables) */
+};
+
+struct nh3_vm {
+    mpdm_t prg;             /* program */
+    int32_t *code;          /* program code */
+    mpdm_t pool;            /* program constant pool */
+    mpdm_t ctxt;            /* context */
+    struct nh3_val *stack;  /* stack */
+    int *c_stack;           /* call stack (return pc, fp and tt) */
+    mpdm_t symtbl;          /* local symbol table */
+    mpdm_t frame;           /* empty symbol table, for frames with no names */
+    int argc;               /* arguments of the call (stack slots) */
+    int call;               /* address of the native call being run */
+    int pc;                 /* program counter */
+    int sp;                 /* stack pointer */
+    int fp;                 /* frame pointer (local slots) */
+    int cs;                 /* call stack pointer */
+    int tt;                 /* symbol table top */
+    int stack_i;            /* stack allocated size */
+    int c_stack_i;          /* call stack allocated size */
+    int mode;               /* running mode */
+    long long ins;          /* # of executed instructions (at last check) */
+    int tick;               /* instructions left until the next check */
+    int slice;              /* instructions between checks */
+    int32_t *lines;         /* program line table */
+    int lines_n;            /* line table size */
+    int max_ins;            /* max executed instructions (0, no max) */
+    int msecs;              /* max running milliseconds (0, no max) */
+    long long max;          /* running time deadline (msecs) */
+    long long pause;        /* # of executed instructions to stop at (0, never) */
+    struct nh3_ic *ic;      /* inline caches */
+    int ic_i;               /* inline caches allocated size */
+    int stamp;              /* symbol stamp */
+    int ic_hits;            /* inline cache hits */
+    int ic_misses;          /* inline cache misses */
+    int task;               /* worker + 1, if a spawned task */
+    struct nh3_vm *next;    /* next task in a run queue */
+    mpdm_t wait;            /* park token of a waiting task */
+    mpdm_t sem;             /* semaphore to block on channels (not tasks) */
+    long long sleep;        /* wake-up time of a sleeping task (sched_clock()) */
+    mpdm_t done;            /* future of a task */
+    mpdm_t job;             /* parallel map of a task */
+    int job_c;              /* parallel map chunk */
+    int job_i;              /* parallel map element */
+    int job_e;              /* parallel map chunk end */
+    int resumable;          /* run in slices (by nh3_vm_run()) */
+    mpdm_t joined;          /* parallel map job it waits for, if resumable */
+};
+
+/*
+    Symbol lookups (TBL) cache, per site, where the symbol was found.
+    A cached entry is valid while the symbol table top is the same and
+    no symbol that could shadow it has been created since; the symbol
+    stamp is incremented every time a hash gets a new key by assignment
+    (SET), a hash with keys is pushed to the symbol table (TPU) or
+    named arguments are created (ARG). This includes the hashes created
+    by iterators, as their key and value can shadow other symbols. Keys
+    created by native code are not tracked.
+*/
+
+/* global inline cache counters (updated under spare_mutex) */
+static int ic_hits = 0;
+static int ic_misses = 0;
+
+void nh3_ic_stats(int *hits, int *misses)
+{
+    *hits   = ic_hits;
+    *misses = ic_misses;
+}
+
+/*
+    Stack ownership: every one of the stack_i slots of the stack
+    of type V_VAL holds a reference to its value (or NULL). Pushing
+    references the new value and releases the one previously stored
+    in the slot; popping just moves the stack pointer, so popped values
+    stay alive until their slot is reused or the VM is reset.
+
+    Integer and real temporaries live unboxed in V_INT and V_REAL
+    slots; they are only converted to mpdm values (in place, so the
+    slot owns the new value) when popped as such, i.e. when they
+    escape to an array, a hash or a native call.
+
+    Array and hash literals are pushed as V_LIT slots that share (and
+    reference) the constant in the program pool. They can be read
+    (subscripted, iterated) as they are; a private copy is only made
+    when they escape or are about to be modified. Locals can hold
+    them too: the slot is copied in place when the local is loaded,
+    but its scalar elements are read from the literal (see GTL()).
+*/
+
+static void grow_stack(struct nh3_vm *m, int size)
+{
+    m->stack = realloc(m->stack, size * sizeof(struct nh3_val));
+    memset(&m->stack[m->stack_i], '\0', (size - m->stack_i) * sizeof(struct nh3_val));
+    m->stack_i = size;
+}
+
+
+static void grow_c_stack(struct nh3_vm *m, int size)
+{
+    m->c_stack = realloc(m->c_stack, size * sizeof(int));
+    m->c_stack_i = size;
+}
+
+
+static void grow_ic(struct nh3_vm *m, int size)
+{
+    m->ic = realloc(m->ic, size * sizeof(struct nh3_ic));
+    memset(&m->ic[m->ic_i], '\0', (size - m->ic_i) * sizeof(struct nh3_ic));
+    m->ic_i = size;
+}
+
+
+static void job_abandon(mpdm_t j);
+
+static void reset_vm(struct nh3_vm *m, mpdm_t prg)
+/* prepares a VM to run prg (or to be reused, if NULL), keeping
+   its stacks and symbol tables allocated */
+{
+    int n;
+
+    mpdm_set(&m->prg,   prg);
+
+    /* the inline caches point to the previous program's tables */
+    if (m->ic != NULL)
+        memset(m->ic, '\0', m->ic_i * sizeof(struct nh3_ic));
+
+    m->stamp = 0;
+
+    /* release the stack */
+    for (n = 0; n < m->stack_i; n++) {
+        if (m->stack[n].type >= V_VAL)
+            mpdm_unref(m->stack[n].u.v);
+
+        m->stack[n].type = V_INT;
+    }
+
+    if (prg != NULL) {
+        m->code     = (int32_t *)mpdm_aget(prg, 0)->data;
+        m->pool     = mpdm_aget(prg, 1);
+        m->lines    = (int32_t *)mpdm_aget(prg, 2)->data;
+        m->lines_n  = mpdm_size(mpdm_aget(prg, 2));
+
+        if (m->stack == NULL) {
+            grow_stack(m, 256);
+            grow_c_stack(m, 64);
+        }
+
+        if (m->ctxt == NULL) {
+            mpdm_set(&m->ctxt,  MPDM_A(0));
+
+            m->symtbl   = mpdm_push(m->ctxt, MPDM_A(0));
+            m->frame    = mpdm_push(m->ctxt, MPDM_H(0));
+
+            mpdm_push(m->symtbl, mpdm_root());
+        }
+        else
+            /* drop all tables but the root one */
+            mpdm_collapse(m->symtbl, 1, mpdm_size(m->symtbl) - 1);
+
+        mpdm_push(m->symtbl, MPDM_H(0));
+
+        m->pc = m->sp = m->fp = m->cs = m->argc = 0;
+        m->tt = mpdm_size(m->symtbl);
+        m->max_ins  = mpdm_ival(mpdm_aget(prg, 3));
+        m->msecs    = mpdm_ival(mpdm_aget(prg, 4));
+        m->ins      = m->pause = 0;
+        m->max      = 0;
+        m->mode = VM_IDLE;
+    }
+    else {
+        mpdm_set(&m->wait,  NULL);
+        mpdm_set(&m->sem,   NULL);
+        mpdm_set(&m->done,  NULL);
+        mpdm_set(&m->job,   NULL);
+
+        /* the chunks of a job left waiting stop */
+        if (m->joined != NULL) {
+            job_abandon(m->joined);
+            mpdm_set(&m->joined, NULL);
+        }
+
+        m->task     = m->sleep = m->resumable = 0;
+        m->next     = NULL;
+    }
+}
+
+
+/*
+    Spare VMs. Finished VMs (program runs and tasks) are kept reset,
+    with their stacks, inline caches and symbol tables still allocated,
+    to be reused by the next run or spawn instead of building a VM from
+    scratch. As tasks are usually freed by a worker other than the one
+    that created them, the pool is shared by all threads.
+*/
+
+#define MAX_SPARES 64
+
+static struct nh3_vm *spare = NULL;     /* spare VMs */
+static int spares = 0;                  /* number of spare VMs */
+static mpdm_t spare_mutex = NULL;       /* spare VMs lock */
+
+static struct nh3_vm *new_vm(mpdm_t prg)
+/* returns a VM ready to run prg, reusing a spare one if possible */
+{
+    struct nh3_vm *m;
+
+    mpdm_mutex_lock(spare_mutex);
+
+    if ((m = spare) != NULL) {
+        spare = m->next;
+        spares--;
+    }
+
+    mpdm_mutex_unlock(spare_mutex);
+
+    if (m == NULL)
+        m = calloc(1, sizeof(struct nh3_vm));
+    else
+        m->next = NULL;
+
+    reset_vm(m, prg);
+
+    return m;
+}
+
+
+static void destroy_vm(struct nh3_vm *m)
+/* frees a reset VM */
+{
+    mpdm_set(&m->ctxt, NULL);
+
+    free(m->ic);
+    free(m->stack);
+    free(m->c_stack);
+    free(m);
+}
+
+
+static void free_vm(struct nh3_vm *m)
+/* resets a VM and keeps it as a spare, if there is room */
+{
+    reset_vm(m, NULL);
+
+    mpdm_mutex_lock(spare_mutex);
+
+    /* accumulate the inline cache counters (workers free VMs at once) */
+    ic_hits     += m->ic_hits;
+    ic_misses   += m->ic_misses;
+    m->ic_hits  = m->ic_misses = 0;
+
+    if (spares < MAX_SPARES) {
+        m->next = spare;
+        spare   = m;
+        spares++;
+        m = NULL;
+    }
+
+    mpdm_mutex_unlock(spare_mutex);
+
+    if (m != NULL)
+        destroy_vm(m);
+}
+
+
+static int vm_line(struct nh3_vm *m, int pc)
+/* returns the source line of the instruction at pc */
+{
+    int b = 0, t = m->lines_n / 2;
+
+    /* last entry with an address not above pc */
+    while (b < t) {
+        int n = (b + t) / 2;
+
+        if (m->lines[n * 2] <= pc)
+            b = n + 1;
+        else
+            t = n;
+    }
+
+    return b ? m->lines[b * 2 - 1] : 0;
+}
+
+
+static void vm_error(struct nh3_vm *m, mpdm_t s1, mpdm_t s2) 
+{
+    mpdm_t t;
+
+    mpdm_ref(s1);
+    mpdm_ref(s2);
+
+    m->mode = VM_ERROR;
+
+    t = mpdm_fmt(MPDM_LS(L":%d: error: %s"), MPDM_I(vm_line(m, m->pc - 1)));
+    t = mpdm_fmt(t, s1);
+
+    s_error(t, s2); 
+
+    mpdm_unref(s2);
+    mpdm_unref(s1);
+}
+
+static struct nh3_val *SLOT(struct nh3_vm *m)
+/* returns the next stack slot, releasing its previous value */
+{
+    struct nh3_val *s;
+
+    if (m->sp == m->stack_i)
+        grow_stack(m, m->stack_i * 2);
+
+    s = &m->stack[m->sp++];
+
+    if (s->type >= V_VAL)
+        mpdm_unref(s->u.v);
+
+    return s;
+}
+
+static mpdm_t PUSH(struct nh3_vm *m, mpdm_t v)
+{
+    struct nh3_val *s;
+
+    mpdm_ref(v);
+    s = SLOT(m);
+    s->type = V_VAL;
+
+    return s->u.v = v;
+}
+
+static void LPUSH(struct nh3_vm *m, mpdm_t v)
+/* pushes a shared literal */
+{
+    struct nh3_val *s;
+
+    mpdm_ref(v);
+    s = SLOT(m);
+    s->type = V_LIT;
+    s->u.v = v;
+}
+
+static void IPUSH(struct nh3_vm *m, int i) { struct nh3_val *s = SLOT(m); s->type = V_INT; s->u.i = i; }
+static void RPUSH(struct nh3_vm *m, double r) { struct nh3_val *s = SLOT(m); s->type = V_REAL; s->u.r = r; }
+
+static void SPUSH(struct nh3_vm *m, struct nh3_val v)
+/* pushes a copy of a stack slot */
+{
+    if (v.type >= V_VAL)
+        mpdm_ref(v.u.v);
+
+    *SLOT(m) = v;
+}
+
+static mpdm_t BOX(struct nh3_val *s)
+/* converts a stack slot to an mpdm value */
+{
+    if (s->type == V_INT)
+        s->u.v = mpdm_ref(MPDM_I(s->u.i));
+    else
+    if (s->type == V_REAL)
+        s->u.v = mpdm_ref(MPDM_R(s->u.r));
+    else
+    if (s->type == V_LIT) {
+        mpdm_t v = s->u.v;
+
+        s->u.v = mpdm_ref(mpdm_clone(v));
+        mpdm_unref(v);
+    }
+
+    s->type = V_VAL;
+
+    return s->u.v;
+}
+
+static int IVAL(struct nh3_val *s)
+{
+    return s->type == V_INT ? s->u.i : s->type == V_REAL ? (int) s->u.r : mpdm_ival(s->u.v);
+}
+
+static double RVAL(struct nh3_val *s)
+{
+    return s->type == V_REAL ? s->u.r : s->type == V_INT ? (double) s->u.i : mpdm_rval(s->u.v);
+}
+
+static struct nh3_val *SPOP(struct nh3_vm *m) { return &m->stack[--m->sp]; }
+static mpdm_t POP(struct nh3_vm *m) { return BOX(SPOP(m)); }
+static mpdm_t TOS(struct nh3_vm *m) { return BOX(&m->stack[m->sp - 1]); }
+static mpdm_t PEEK(struct nh3_val *s) { return s->type == V_LIT ? s->u.v : BOX(s); }
+static int PC(struct nh3_vm *m) { return m->code[m->pc++]; }
+
+static mpdm_t GET(struct nh3_vm *m, mpdm_t h, struct nh3_val *k)
+{
+    mpdm_t r = NULL;
+
+    if (MPDM_IS_HASH(h))
+        r = mpdm_hget(h, BOX(k));
+    else
+    if (MPDM_IS_ARRAY(h))
+        r = mpdm_aget(h, IVAL(k));
+    else
+    if (MPDM_IS_STRING(h))
+        r = mpdm_slice(h, IVAL(k), 1);
+    else
+        vm_error(m, MPDM_LS(L"bad holder in GET for key "), BOX(k));
+
+    return r;
+}
+
+static void GTL(struct nh3_vm *m, int n)
+/* gets an element of local n: key -> value */
+{
+    struct nh3_val *s = &m->stack[m->fp + n];
+    struct nh3_val *k = SPOP(m);
+    mpdm_t v;
+
+    if (s->type == V_LIT) {
+        /* scalars are read from the literal; containers could be
+           changed through the result, so the local is copied first */
+        if (!MPDM_IS_ARRAY(v = GET(m, s->u.v, k))) {
+            PUSH(m, v);
+            return;
+        }
+
+        BOX(s);
+    }
+
+    PUSH(m, GET(m, PEEK(s), k));
+}
+
+static mpdm_t SET(struct nh3_vm *m, mpdm_t h, struct nh3_val *k, mpdm_t v)
+{
+    mpdm_t r = NULL;
+
+    if (MPDM_IS_HASH(h)) {
+        /* a new key can shadow a cached symbol */
+        if (!mpdm_exists(h, BOX(k)))
+            m->stamp++;
+
+        r = mpdm_hset(h, BOX(k), v);
+    }
+    else
+    if (MPDM_IS_ARRAY(h))
+        r = mpdm_aset(h, v, IVAL(k));
+    else
+        vm_error(m, MPDM_LS(L"bad holder in SET for key "), BOX(k));
+
+    return r;
+}
+
+
+wchar_t *nh3_type(mpdm_t v)
+{
+    wchar_t *t = L"SCALAR";
+
+    if (MPDM_IS_FILE(v))
+        t = L"IO";
+    else
+    if (MPDM_IS_HASH(v))
+        t = L"HASH";
+    else
+    if (MPDM_IS_ARRAY(v))
+        t = L"ARRAY";
+
+    return t;
+}
+
+
+static mpdm_t TBL(struct nh3_vm *m, int i)
+{
+    int n;
+    mpdm_t s = mpdm_ref(POP(m));
     mpdm_t l = NULL;
+    struct nh3_ic *e;
+
+    if (i >= m->ic_i)
+        grow_ic(m, i + 1);
+
+    e = &m->ic[i];
+
+    /* cache hit? */
+    if (e->l && e->stamp == m->stamp && e->tt == m->tt &&
+        (e->n >= 0 ? mpdm_aget(m->symtbl, e->n) == e->l :
+            e->type == nh3_type(mpdm_aget(m->symtbl, m->tt - 1))) &&
+        mpdm_exists(e->l, s)) {
+        m->ic_hits++;
+
+        PUSH(m, e->l);
+        PUSH(m, s);
+
+        mpdm_unref(s);
+
+        return e->l;
+    }
+
+    m->ic_misses++;
+
+    /* local symtable */
+    for (n = m->tt - 1; n >= 0; n--) {
+        /* try down the list and short-circuit on NULL values,
+           jumping down to 0 (global symtable) */
+        if (
+                (l = mpdm_aget(m->symtbl, n)) ||
+                (l = mpdm_aget(m->symtbl, (n = 0)))
+            ) {
+            if (mpdm_exists(l, s))
+                break;
+        }
+    }
+
+    if (n < 0) {
+        mpdm_t v = mpdm_aget(m->symtbl, m->tt - 1);
+        l = NULL;
+
+        /* still not found? try on the type-specific tables */
+        v = mpdm_hget_s(mpdm_root(), nh3_type(v));
+
+        if (mpdm_exists(v, s))
+            l = v;
+    }
+
+    if (l == NULL)
+        vm_error(m, MPDM_LS(L"undefined symbol "), s);
+    else {
+        e->l        = l;
+        e->n        = n;
+        e->tt       = m->tt;
+        e->stamp    = m->stamp;
+        e->type     = nh3_type(mpdm_aget(m->symtbl, m->tt - 1));
+
+        PUSH(m, l);
+        PUSH(m, s);
+    }
+
+    mpdm_unref(s);
+
+    return l;
+}
+
+
+static void SSET(struct nh3_val *d, struct nh3_val *s)
+/* copies a stack slot over another */
+{
+    if (s->type >= V_VAL)
+        mpdm_ref(s->u.v);
+    if (d->type >= V_VAL)
+        mpdm_unref(d->u.v);
+
+    *d = *s;
+}
+
+
+static void SINT(struct nh3_val *d, int i)
+/* stores an integer in a stack slot */
+{
+    if (d->type >= V_VAL)
+        mpdm_unref(d->u.v);
+
+    d->type = V_INT;
+    d->u.i  = i;
+}
+
+
+static void SVAL(struct nh3_val *d, mpdm_t v)
+/* stores a value in a stack slot */
+{
+    struct nh3_val s;
+
+    s.type  = V_VAL;
+    s.u.v   = v;
+    SSET(d, &s);
+}
+
+
+/*
+    Lazy iterables (ranges and generators) are executable values:
+    they are iterated by calling them with the iteration index until
+    they return the end mark, so the sequence is never built.
+*/
+
+static mpdm_t end_mark = NULL;          /* end of a lazy iterable */
+static mpdm_t park_mark = NULL;         /* first element of park tokens */
+
+static mpdm_t gen_run(struct nh3_vm *m, mpdm_t h);
+
+static int iterate(struct nh3_vm *m, mpdm_t set, int *n, mpdm_t *k, mpdm_t *v)
+/* like mpdm_iterator(), but also walking lazy iterables (generators on
+   the budget of the VM m, if any); returns -1 if it ran out of it */
+{
+    mpdm_t a;
+
+    if (!MPDM_IS_EXEC(set))
+        return mpdm_iterator(set, n, k, v);
+
+    a = mpdm_ref(MPDM_A(1));
+    *k = mpdm_ref(MPDM_I(*n));
+
+    mpdm_aset(a, *k, 0);
+    *v = mpdm_ref(mpdm_exec(set, a, NULL));
+
+    /* generators are resumed here */
+    if (MPDM_IS_ARRAY(*v) && mpdm_aget(*v, 0) == park_mark)
+        mpdm_set(v, gen_run(m, mpdm_aget(*v, 4)));
+
+    mpdm_unref(a);
+    mpdm_unrefnd(*k);
+    mpdm_unrefnd(*v);
+
+    if (m != NULL && m->mode == VM_TIMEOUT) {
+        mpdm_void(*k);
+        return -1;
+    }
+
+    if (*v == end_mark) {
+        mpdm_void(*k);
+        return 0;
+    }
+
+    (*n)++;
+
+    return 1;
+}
+
+
+static int ITS(struct nh3_vm *m, int i)
+/* iterates the set under the index on the top of the stack, storing
+   its next key and value in the local slots i and i + 1; returns 0
+   at the end (and -1 if out of budget). Counts and arrays are iterated
+   without allocations */
+{
+    struct nh3_val *s = &m->stack[m->sp - 2];
+    struct nh3_val *x = &m->stack[m->sp - 1];
+    struct nh3_val *k = &m->stack[m->fp + i];
+    int n = IVAL(x);
+    mpdm_t w1, w2;
+
+    if (s->type == V_INT || s->type == V_REAL ||
+        (IS_NUM(s->u.v) && !MPDM_IS_ARRAY(s->u.v))) {
+        if (n >= IVAL(s))
+            return 0;
+
+        SINT(k, n);
+        SINT(k + 1, n++);
+    }
+    else
+    if (MPDM_IS_ARRAY(s->u.v) && !MPDM_IS_HASH(s->u.v) && !MPDM_IS_EXEC(s->u.v)) {
+        if (n >= mpdm_size(s->u.v))
+            return 0;
+
+        w2 = mpdm_aget(s->u.v, n);
+
+        SINT(k, n++);
+        SVAL(k + 1, s->type == V_LIT ? mpdm_clone(w2) : w2);
+    }
+    else {
+        int r;
+
+        if ((r = iterate(m, s->u.v, &n, &w1, &w2)) < 1)
+            return r;
+
+        SVAL(k, w1);
+        SVAL(k + 1, s->type == V_LIT ? mpdm_clone(w2) : w2);
+    }
+
+    SINT(x, n);
+
+    return 1;
+}
+
+
+static void ENT(struct nh3_vm *m, int n, int p)
+/* opens a frame of n local slots, the first p ones holding the
+   arguments of the call (that are on the stack) */
+{
+    m->fp   = m->sp - m->argc;
+    m->argc = 0;
+
+    /* extra arguments are dropped (not left in the locals' slots) */
+    if (m->sp > m->fp + p)
+        m->sp = m->fp + p;
+
+    while (m->sp < m->fp + n)
+        PUSH(m, NULL);
+}
+
+
+static void FRM(struct nh3_vm *m, int n, int p)
+/* opens a subroutine frame of n local slots (p of them
+   arguments) and no names */
+{
+    ENT(m, n, p);
+    mpdm_aset(m->symtbl, m->frame, m->tt++);
+}
+
+
+static void ARG(struct nh3_vm *m, int n)
+/* opens a subroutine frame of n local slots, creating a local
+   symbol table with the arguments that have a name */
+{
+    mpdm_t h, k;
+    int i;
+
+    k = mpdm_ref(PEEK(SPOP(m)));
+
+    ENT(m, n, mpdm_size(k));
+    h = mpdm_aset(m->symtbl, MPDM_H(0), m->tt++);
+
+    for (i = 0; i < mpdm_size(k); i++) {
+        if (mpdm_aget(k, i) != NULL) {
+            mpdm_hset(h, mpdm_aget(k, i), BOX(&m->stack[m->fp + i]));
+            m->stamp++;
+        }
+    }
+
+    mpdm_unref(k);
+}
+
+
+int nh3_is_true(mpdm_t v)
+{
+    /* if value is NULL, it's false */
+    if (v == NULL)
+        return 0;
+
+    /* if it's a printable string... */
+    if (v->flags & MPDM_STRING) {
+        wchar_t *ptr = mpdm_string(v);
+
+        /* ... and it's "" or the "0" string, it's false */
+        if (*ptr == L'\0' || (*ptr == L'0' && *(ptr + 1) == L'\0'))
+            return 0;
+    }
+
+    /* any other case is true */
+    return 1;
+}
+
+
+static int ISTRU(struct nh3_val *s)
+{
+    return s->type == V_INT ? s->u.i != 0 : s->type == V_REAL ? s->u.r != 0.0 : nh3_is_true(s->u.v);
+}
+
+static int EQ(struct nh3_val *v, struct nh3_val *w)
+{
+    if (v->type == V_INT && w->type == V_INT)
+        return v->u.i == w->u.i;
+
+    /* NULL (in a value or literal slot) is only equal to itself */
+    if ((v->type >= V_VAL && v->u.v == NULL) || (w->type >= V_VAL && w->u.v == NULL))
+        return v->type >= V_VAL && w->type >= V_VAL && v->u.v == w->u.v;
+
+    return RVAL(v) == RVAL(w);
+}
+
+static int NUM(struct nh3_val *s, int *i, double *r)
+/* gets the numeric value of a slot into r; returns 1 (and sets i) if integral */
+{
+    if (s->type == V_INT) {
+        *r = (double) (*i = s->u.i);
+        return 1;
+    }
+
+    *r = RVAL(s);
+
+    if (*r >= INT_MIN && *r <= INT_MAX && *r == (double) (int) *r) {
+        *i = (int) *r;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* integer arithmetic if both are integral and the result fits, real otherwise */
+#define ARITH(m, op) do { struct nh3_val *b = SPOP(m), *a = SPOP(m); long long l; \
+    if (NUM(a, &i1, &r1) & NUM(b, &i2, &r2)) { \
+        l = (long long) i1 op (long long) i2; \
+        if (l >= INT_MIN && l <= INT_MAX) IPUSH(m, (int) l); else RPUSH(m, (double) l); \
+    } else RPUSH(m, r1 op r2); } while (0)
+
+/* comparison, specialized for immediate integers */
+#define CMP(m, op) do { struct nh3_val *b = SPOP(m), *a = SPOP(m); \
+    IPUSH(m, a->type == V_INT && b->type == V_INT ? a->u.i op b->u.i : RVAL(a) op RVAL(b)); } while (0)
+
+/* comparison and jump if false */
+#define JCMP(m, op) do { struct nh3_val *b = SPOP(m), *a = SPOP(m); \
+    if (a->type == V_INT && b->type == V_INT ? a->u.i op b->u.i : RVAL(a) op RVAL(b)) \
+    m->pc++; else JUMP(m); } while (0)
+
+#define IPOP(m) IVAL(SPOP(m))
+#define RPOP(m) RVAL(SPOP(m))
+
+static void BINOP(struct nh3_vm *m, nh3_op_t op)
+/* executes a binary operator for the fused opcodes */
+{
+    mpdm_t v, w;
+    double r1, r2;
+    int i1, i2;
+
+    switch (op) {
+    case OP_ADD: ARITH(m, +); break;
+    case OP_SUB: ARITH(m, -); break;
+    case OP_MUL: ARITH(m, *); break;
+    case OP_DIV: r2 = RPOP(m); r1 = RPOP(m); RPUSH(m, r1 / r2); break;
+    case OP_MOD: i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 % i2); break;
+    case OP_AND: i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 &  i2); break;
+    case OP_OR:  i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 |  i2); break;
+    case OP_XOR: i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 ^  i2); break;
+    case OP_CAT: w = POP(m); v = POP(m); PUSH(m, mpdm_join(v, w)); break;
+    default:     vm_error(m, MPDM_LS(L"bad fused operator"), MPDM_I(op)); break;
+    }
+}
+
+static void ISL(struct nh3_vm *m, int n, nh3_op_t op)
+/* in-place operation on a local slot with the value on top of the stack */
+{
+    struct nh3_val *s = &m->stack[m->fp + n], *w = &m->stack[m->sp - 1], t;
+    long long l;
+    double r;
+    int i;
+
+    /* integers are updated in place */
+    if (s->type == V_INT && NUM(w, &i, &r)) {
+        l = op == OP_ADD ? (long long) s->u.i + i : (long long) s->u.i - i;
+
+        if (l >= INT_MIN && l <= INT_MAX) {
+            s->u.i = (int) l;
+            SPOP(m);
+            IPUSH(m, s->u.i);
+            return;
+        }
+    }
+
+    /* operand, value -> value, operand */
+    SPUSH(m, *s);
+    t = m->stack[m->sp - 1];
+    m->stack[m->sp - 1] = m->stack[m->sp - 2];
+    m->stack[m->sp - 2] = t;
+
+    BINOP(m, op);
+
+    if ((s = &m->stack[m->sp - 1])->type == V_LIT)
+        BOX(s);
+
+    SSET(&m->stack[m->fp + n], s);
+}
+
+static void GMS(struct nh3_vm *m, nh3_op_t op)
+/* get-modify-set: holder, key, operand -> result */
+{
+    mpdm_t h, v, w;
+    struct nh3_val *k;
+
+    /* holder, key, operand -> holder, key, value, operand */
+    h = BOX(&m->stack[m->sp - 3]);
+    v = mpdm_ref(GET(m, h, &m->stack[m->sp - 2]));
+
+    SLOT(m);
+    m->stack[m->sp - 1] = m->stack[m->sp - 2];
+    m->stack[m->sp - 2].type = V_VAL;
+    m->stack[m->sp - 2].u.v = v;
+
+    BINOP(m, op);
+
+    w = POP(m); k = SPOP(m); PUSH(m, SET(m, POP(m), k, w));
+}
+
+/* instructions between budget checks */
+#define VM_SLICE 65536
+
+static long long vm_clock(void)
+/* returns a monotonic time in milliseconds */
+{
+#ifdef CONFOPT_CLOCK_GETTIME
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    return (long long)clock() * 1000 / CLOCKS_PER_SEC;
+#endif
+}
+
+
+static void vm_account(struct nh3_vm *m)
+/* accounts the instructions executed since the last check */
+{
+    m->ins += m->slice - m->tick;
+    m->slice = m->tick = 0;
+}
+
+
+static void vm_limit(struct nh3_vm *m, struct nh3_vm *p)
+/* starts the budget of a VM; tasks get the deadline and
+   the instructions left to their spawner p */
+{
+    m->ins = 0;
+
+    if (p != NULL) {
+        vm_account(p);
+
+        if (p->max_ins)
+            m->max_ins = p->ins < p->max_ins ? (int) (p->max_ins - p->ins) : 1;
+        else
+            m->max_ins = 0;
+
+        m->max = p->max;
+    }
+    else
+        m->max = m->msecs ? vm_clock() + m->msecs : 0;
+}
+
+
+static int vm_spent(struct nh3_vm *m)
+/* returns 1 if a VM has run out of its budget */
+{
+    return (m->max_ins && m->ins >= m->max_ins) || (m->max && vm_clock() > m->max);
+}
+
+
+static void vm_budget(struct nh3_vm *m)
+/* accounts the executed instructions and stops if out of budget
+   or at the pause (where it can be run again) */
+{
+    vm_account(m);
+
+    if (vm_spent(m) || (m->pause && m->ins >= m->pause))
+        m->mode = VM_TIMEOUT;
+    else {
+        m->slice = VM_SLICE;
+
+        if (m->max_ins && m->max_ins - m->ins < m->slice)
+            m->slice = (int) (m->max_ins - m->ins);
+
+        if (m->pause && m->pause - m->ins < m->slice)
+            m->slice = (int) (m->pause - m->ins);
+
+        m->tick = m->slice;
+    }
+}
+
+/* accounts an executed instruction; the budget is only checked
+   when jumping backwards and calling, where loops can happen */
+#define VM_TICK()   m->tick--
+#define VM_CHECK()  if (m->tick <= 0) vm_budget(m)
+
+/* jumps to the operand */
+#define JUMP(m) do { i1 = PC(m); if (i1 < m->pc) VM_CHECK(); m->pc = i1; } while (0)
+
+#ifdef CONFOPT_COMPUTED_GOTO
+
+/* threaded dispatch: each handler jumps directly to the next one */
+#define OP(o)       L_##o
+#define DISPATCH()  if (m->mode == VM_RUNNING) goto *labels[PC(m)]; goto vm_exit
+#define NEXT        VM_TICK(); DISPATCH()
+#define VM_START    DISPATCH();
+#define VM_END      vm_exit: (void) 0
+
+#else
+
+/* portable dispatch: a switch inside a loop */
+#define OP(o)       case o
+#define NEXT        break
+#define VM_START    while (m->mode == VM_RUNNING) { switch (PC(m)) {
+#define VM_END      } VM_TICK(); }
+
+#endif /* CONFOPT_COMPUTED_GOTO */
+
+static int exec_vm(struct nh3_vm *m);
+
+static mpdm_t exec_vm_a0(mpdm_t c, mpdm_t a, mpdm_t ctxt)
+{
+    mpdm_t r = NULL;
+    struct nh3_vm *m = new_vm(c);
+    int n;
+
+    /* set program counter */
+    m->pc = mpdm_ival(mpdm_aget(a, 0));
+    vm_limit(m, NULL);
+
+    /* push the rest of arguments to the stack */
+    for (n = 1; n < mpdm_size(a); n++)
+        PUSH(m, mpdm_aget(a, n));
+
+    r = MPDM_I(exec_vm(m));
+
+    free_vm(m);
+
+    return r;
+}
+
+
+/** generators and ranges **/
+
+/*
+    A subroutine that yields is a generator: calling it creates a
+    suspended VM that runs the rest of the subroutine with the call
+    arguments, returned as a lazy iterable. Every call to it returns
+    a park token, and the calling VM resumes the generator in its
+    thread and on its budget until the next yield or its end, when
+    the VM is released (and further calls return NULL, or end the
+    iteration). Like spawned subroutines, it only sees the caller's
+    globals.
+
+    As values have no destructors, the VMs of generators dropped before
+    their end are reclaimed by sweeping the list of live ones, that
+    holds the only reference left to them, when it has doubled in size
+    since the last sweep (and on shutdown).
+*/
+
+static mpdm_t gens = NULL;              /* live generators */
+static mpdm_t gen_mutex = NULL;         /* live generators lock */
+static int gen_sweep_at = 16;           /* live generators for the next sweep */
+
+static void gen_sweep(int all)
+/* returns to the pool the VMs of the generators no longer
+   referenced (or all of them) */
+{
+    mpdm_t l = mpdm_ref(MPDM_A(0));
+    mpdm_t d = mpdm_ref(MPDM_A(0));
+    int n;
+
+    mpdm_mutex_lock(gen_mutex);
+
+    for (n = 0; n < mpdm_size(gens); n++) {
+        mpdm_t h = mpdm_aget(gens, n);
+
+        mpdm_push(all || h->ref == 1 ? d : l, h);
+    }
+
+    mpdm_set(&gens, l);
+    gen_sweep_at = 2 * mpdm_size(l) + 16;
+
+    mpdm_mutex_unlock(gen_mutex);
+
+    for (n = 0; n < mpdm_size(d); n++) {
+        mpdm_t v = mpdm_aget(mpdm_aget(d, n), 0);
+
+        if (v != NULL) {
+            free_vm((struct nh3_vm *)v->data);
+            mpdm_aset(mpdm_aget(d, n), NULL, 0);
+        }
+    }
+
+    mpdm_unref(d);
+    mpdm_unref(l);
+}
+
+
+static void gen_keep(mpdm_t h)
+/* adds a generator to the list of live ones */
+{
+    int n;
+
+    mpdm_mutex_lock(gen_mutex);
+
+    mpdm_push(gens, h);
+    n = mpdm_size(gens) >= gen_sweep_at;
+
+    mpdm_mutex_unlock(gen_mutex);
+
+    if (n)
+        gen_sweep(0);
+}
+
+
+static mpdm_t gen_next(mpdm_t t, mpdm_t a, mpdm_t ctxt)
+/* returns the token for the calling VM to resume a generator */
+{
+    return t;
+}
+
+
+static mpdm_t gen_run(struct nh3_vm *m, mpdm_t h)
+/* resumes the generator in h on the budget left to the VM m (if any):
+   returns the next yielded value, or the end mark once the subroutine
+   has finished; if it runs out of the budget, m is stopped */
+{
+    mpdm_t v = mpdm_aget(h, 0);
+    struct nh3_vm *g;
+
+    /* finished, or being run (a generator calling itself) */
+    if (v == NULL || ((g = (struct nh3_vm *)v->data)->mode != VM_YIELD &&
+        g->mode != VM_TIMEOUT))
+        return end_mark;
+
+    g->ins = g->pause = g->max_ins = 0;
+    g->max = 0;
+
+    if (m != NULL) {
+        /* account the instructions run by m so far */
+        vm_account(m);
+
+        if (vm_spent(m)) {
+            m->mode = VM_TIMEOUT;
+            return NULL;
+        }
+
+        if (m->max_ins)
+            g->max_ins = (int) (m->max_ins - m->ins);
+
+        g->max = m->max;
+    }
+
+    exec_vm(g);
+
+    if (m != NULL) {
+        /* the caller is charged with its instructions */
+        m->ins += g->ins;
+
+        if (g->mode == VM_TIMEOUT) {
+            m->mode = VM_TIMEOUT;
+            return NULL;
+        }
+    }
+
+    /* the yield popped the value */
+    if (g->mode == VM_YIELD)
+        return BOX(&g->stack[g->sp]);
+
+    free_vm(g);
+    mpdm_aset(h, NULL, 0);
+
+    return end_mark;
+}
+
+
+static void GEN(struct nh3_vm *m)
+/* returns a generator to the caller of the subroutine */
+{
+    struct nh3_vm *g = new_vm(m->prg);
+    mpdm_t t = MPDM_A(5);
+    mpdm_t h = MPDM_A(1);
+    int b = m->sp - m->argc;
+    int n;
+
+    mpdm_aset(g->symtbl, mpdm_aget(m->symtbl, 1), 1);
+
+    /* it starts after this instruction, with the arguments */
+    for (n = b; n < m->sp; n++)
+        SPUSH(g, m->stack[n]);
+
+    g->argc     = m->argc;
+    g->pc       = m->pc;
+    g->mode     = VM_YIELD;
+
+    /* the token to resume it: [ park mark, ..., [ VM ] ] */
+    mpdm_aset(h, mpdm_new(0, g, 0), 0);
+    mpdm_aset(t, park_mark, 0);
+    mpdm_aset(t, h, 4);
+    gen_keep(h);
+
+    /* return it, as RET */
+    m->sp   = b;
+    m->argc = 0;
+    PUSH(m, MPDM_X2(gen_next, t));
+
+    if (m->cs) {
+        m->tt = m->c_stack[--m->cs];
+        m->fp = m->c_stack[--m->cs];
+        m->pc = m->c_stack[--m->cs];
+    }
+    else
+        m->mode = VM_IDLE;
+}
+
+
+static mpdm_t range_at(mpdm_t r, mpdm_t a, mpdm_t ctxt)
+/* returns the element of a range at an index, or the end mark */
+{
+    double to   = mpdm_rval(mpdm_aget(r, 1));
+    double step = mpdm_rval(mpdm_aget(r, 2));
+    double v    = mpdm_rval(mpdm_aget(r, 0)) + mpdm_ival(mpdm_aget(a, 0)) * step;
+
+    if (step == 0.0 || (step > 0.0 ? v > to : v < to))
+        return end_mark;
+
+    return v == (double) (int) v ? MPDM_I((int) v) : MPDM_R(v);
+}
+
+
+mpdm_t nh3_range(mpdm_t from, mpdm_t to, mpdm_t step)
+/* returns a lazy range from from to to (both included), by step
+   (if NULL, 1 or -1) */
+{
+    mpdm_t r = MPDM_A(3);
+
+    if (step == NULL)
+        step = MPDM_I(mpdm_rval(from) > mpdm_rval(to) ? -1 : 1);
+
+    mpdm_aset(r, from, 0);
+    mpdm_aset(r, to, 1);
+    mpdm_aset(r, step, 2);
+
+    return MPDM_X2(range_at, r);
+}
+
+
+/** tasks **/
+
+/*
+    Spawned subroutines (&sub) run as tasks: VMs of their own, run in
+    slices of instructions by a fixed pool of worker threads (one per
+    processor). Each worker has its own run queue, and takes tasks
+    from the others' when it is empty.
+
+    Tasks talk to the spawner through a pair of channels, and their
+    return value is delivered to it through a future (see below).
+    Reading from a channel, waiting for a future and sleeping return
+    a park token from the native call; the VM then takes the value
+    from the channel itself or, if there is none (or it is sleeping),
+    the task is parked (taken out of the run queues, the call to be
+    retried when resumed) until a value is written or the time passes.
+    A VM that is not a task just blocks its thread.
+*/
+
+/* instructions a task runs before yielding to others */
+#define TASK_SLICE  10000
+
+/* maximum number of workers */
+#define MAX_WORKERS 64
+
+struct nh3_runq {
+    struct nh3_vm *head;    /* first task */
+    struct nh3_vm *tail;    /* last task */
+    mpdm_t mutex;           /* queue lock */
+};
+
+static struct nh3_runq runq[MAX_WORKERS];
+static int workers = 0;                 /* number of workers */
+static int spawns = 0;                  /* spawns from outside tasks */
+static struct nh3_vm *sleepers = NULL;  /* sleeping tasks */
+static mpdm_t sched_mutex = NULL;       /* workers and sleepers lock */
+static mpdm_t ready = NULL;             /* # of tasks in the run queues */
+static mpdm_t sched_alarm = NULL;       /* timer wakeup */
+static long long sched_ticks = 0;       /* timer passes (without a monotonic clock) */
+
+static long long sched_clock(void)
+/* returns the time sleeping tasks wake up by, in milliseconds */
+{
+#ifdef CONFOPT_CLOCK_GETTIME
+    return vm_clock();
+#else
+    /* clock() doesn't advance while sleeping: count the timer passes */
+    return sched_ticks;
+#endif
+}
+
+mpdm_t nh3_park(mpdm_t d, int n)
+/* returns a token to park the calling VM: on a channel, to take
+   a value (n == 0) or to call again when it has one (n != 0),
+   or sleeping n milliseconds (d == NULL) */
+{
+    mpdm_t t = MPDM_A(3);
+
+    mpdm_aset(t, park_mark, 0);
+    mpdm_aset(t, d, 1);
+    mpdm_aset(t, MPDM_I(n), 2);
+
+    return t;
+}
+
+
+static void task_ready(struct nh3_vm *m)
+/* appends a task to the run queue of its worker */
+{
+    struct nh3_runq *q = &runq[m->task - 1];
+
+    m->next = NULL;
+
+    mpdm_mutex_lock(q->mutex);
+
+    if (q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+
+    q->tail = m;
+
+    mpdm_mutex_unlock(q->mutex);
+
+    mpdm_semaphore_post(ready);
+}
+
+
+static struct nh3_vm *task_take(int w)
+/* takes a task from the run queue of a worker or, if empty, from others */
+{
+    struct nh3_vm *m = NULL;
+    int n;
+
+    /* the ready semaphore guarantees there is one */
+    for (n = 0; m == NULL; n++) {
+        struct nh3_runq *q = &runq[(w + n) % workers];
+
+        mpdm_mutex_lock(q->mutex);
+
+        if ((m = q->head) != NULL && (q->head = m->next) == NULL)
+            q->tail = NULL;
+
+        mpdm_mutex_unlock(q->mutex);
+    }
+
+    return m;
+}
+
+
+static void task_wake(struct nh3_vm *m)
+/* resumes a VM waiting on a channel */
+{
+    if (m->task)
+        task_ready(m);
+    else
+        mpdm_semaphore_post(m->sem);
+}
+
+
+static mpdm_t chan_new(void)
+/* creates a channel: [ values, lock, waiting VMs ] */
+{
+    mpdm_t d = MPDM_A(3);
+
+    mpdm_aset(d, MPDM_A(0), 0);
+    mpdm_aset(d, mpdm_new_mutex(), 1);
+    mpdm_aset(d, MPDM_A(0), 2);
+
+    return d;
+}
+
+
+static int chan_wait(mpdm_t d, mpdm_t e)
+/* registers a VM (an entry holding it) as waiting on a channel,
+   unless it has values */
+{
+    int r;
+
+    mpdm_mutex_lock(mpdm_aget(d, 1));
+
+    if ((r = (mpdm_size(mpdm_aget(d, 0)) == 0)))
+        mpdm_push(mpdm_aget(d, 2), e);
+
+    mpdm_mutex_unlock(mpdm_aget(d, 1));
+
+    return r;
+}
+
+
+static int chan_unwait(mpdm_t d, mpdm_t e)
+/* takes a waiting VM entry out of a channel; returns 0 if
+   it's not there (it was woken up) */
+{
+    mpdm_t q = mpdm_aget(d, 2);
+    int n;
+
+    mpdm_mutex_lock(mpdm_aget(d, 1));
+
+    for (n = mpdm_size(q) - 1; n >= 0 && mpdm_aget(q, n) != e; n--);
+
+    if (n >= 0)
+        mpdm_adel(q, n);
+
+    mpdm_mutex_unlock(mpdm_aget(d, 1));
+
+    return n >= 0;
+}
+
+
+static int chan_empty(mpdm_t d)
+/* returns 1 if a channel has no values */
+{
+    int r;
+
+    mpdm_mutex_lock(mpdm_aget(d, 1));
+    r = (mpdm_size(mpdm_aget(d, 0)) == 0);
+    mpdm_mutex_unlock(mpdm_aget(d, 1));
+
+    return r;
+}
+
+
+static int chan_take(mpdm_t d, struct nh3_vm *m)
+/* moves the first value of a channel to the stack; 0 if there is none */
+{
+    mpdm_t q = mpdm_aget(d, 0);
+    int r;
+
+    mpdm_mutex_lock(mpdm_aget(d, 1));
+
+    if ((r = mpdm_size(q))) {
+        /* the stack references it before the channel releases it */
+        PUSH(m, mpdm_aget(q, 0));
+        mpdm_adel(q, 0);
+    }
+
+    mpdm_mutex_unlock(mpdm_aget(d, 1));
+
+    return r;
+}
+
+
+static void chan_put(mpdm_t d, mpdm_t v)
+/* adds a value to a channel, waking up a waiting reader */
+{
+    mpdm_mutex_lock(mpdm_aget(d, 1));
+
+    mpdm_push(mpdm_aget(d, 0), v);
+
+    if (mpdm_size(mpdm_aget(d, 2))) {
+        mpdm_t w = mpdm_ref(mpdm_shift(mpdm_aget(d, 2)));
+
+        task_wake((struct nh3_vm *)w->data);
+        mpdm_unref(w);
+    }
+
+    mpdm_mutex_unlock(mpdm_aget(d, 1));
+}
+
+
+/*
+    The future of a task is a channel that gets its only value, the
+    return value of the subroutine, when it finishes or is cancelled.
+    The value is never taken, so all waiters are woken up, and it
+    also keeps a list of channels to be signalled (for wait_any()) and
+    where the task was last parked (to take it out if cancelled).
+*/
+
+static mpdm_t fut_new(void)
+/* creates a future: [ value, lock, waiting VMs, channels to signal,
+   [ channel, entry ] of the parked task ] */
+{
+    mpdm_t f = chan_new();
+
+    mpdm_push(f, MPDM_A(0));
+    mpdm_push(f, NULL);
+
+    return f;
+}
+
+
+static int fut_ready(mpdm_t f, mpdm_t *v)
+/* returns if a future has a value (and the value) */
+{
+    int r = 1;
+
+    if (f != NULL) {
+        mpdm_mutex_lock(mpdm_aget(f, 1));
+
+        if ((r = mpdm_size(mpdm_aget(f, 0))) && v != NULL)
+            *v = mpdm_aget(mpdm_aget(f, 0), 0);
+
+        mpdm_mutex_unlock(mpdm_aget(f, 1));
+    }
+    else
+    if (v != NULL)
+        *v = NULL;
+
+    return r;
+}
+
+
+static void fut_done(mpdm_t f, mpdm_t v)
+/* sets the value of a future (if not already set) */
+{
+    mpdm_t q;
+
+    mpdm_mutex_lock(mpdm_aget(f, 1));
+
+    if (mpdm_size(mpdm_aget(f, 0)) == 0) {
+        mpdm_push(mpdm_aget(f, 0), v);
+
+        /* wake up everybody */
+        q = mpdm_aget(f, 2);
+        while (mpdm_size(q)) {
+            mpdm_t w = mpdm_ref(mpdm_shift(q));
+
+            task_wake((struct nh3_vm *)w->data);
+            mpdm_unref(w);
+        }
+
+        q = mpdm_aget(f, 3);
+        while (mpdm_size(q))
+            chan_put(mpdm_shift(q), MPDM_I(1));
+    }
+
+    mpdm_mutex_unlock(mpdm_aget(f, 1));
+}
+
+
+static int fut_listen(mpdm_t f, mpdm_t d)
+/* adds a channel to be signalled when a future gets its value;
+   returns 1 if it already has it */
+{
+    int r = 1;
+
+    if (f != NULL) {
+        mpdm_mutex_lock(mpdm_aget(f, 1));
+
+        if ((r = mpdm_size(mpdm_aget(f, 0))) == 0)
+            mpdm_push(mpdm_aget(f, 3), d);
+
+        mpdm_mutex_unlock(mpdm_aget(f, 1));
+    }
+
+    return r;
+}
+
+
+static void fut_unlisten(mpdm_t f, mpdm_t d)
+/* removes a channel to be signalled from a future */
+{
+    mpdm_t q;
+    int n;
+
+    if (f != NULL) {
+        mpdm_mutex_lock(mpdm_aget(f, 1));
+
+        q = mpdm_aget(f, 3);
+
+        for (n = mpdm_size(q) - 1; n >= 0; n--) {
+            if (mpdm_aget(q, n) == d)
+                mpdm_adel(q, n);
+        }
+
+        mpdm_mutex_unlock(mpdm_aget(f, 1));
+    }
+}
+
+
+static void task_park(struct nh3_vm *m)
+/* parks a task that is waiting on a channel or sleeping */
+{
+    mpdm_t t = m->wait;
+    mpdm_t d = mpdm_aget(t, 1);
+
+    /* the token is owned here from now on */
+    m->wait = NULL;
+    m->mode = VM_TIMEOUT;
+
+    if (d == NULL) {
+        mpdm_mutex_lock(sched_mutex);
+
+        m->sleep = sched_clock() + mpdm_ival(mpdm_aget(t, 2));
+        m->next  = sleepers;
+        sleepers = m;
+
+        mpdm_mutex_unlock(sched_mutex);
+
+        mpdm_semaphore_post(sched_alarm);
+    }
+    else {
+        mpdm_t f = mpdm_ref(m->done);
+        mpdm_t e = mpdm_ref(mpdm_new(0, m, 0));
+
+        /* the future knows where the task is parked (set before
+           parking, as it's not owned here after that) */
+        if (f != NULL) {
+            mpdm_t p = MPDM_A(2);
+
+            mpdm_aset(p, d, 0);
+            mpdm_aset(p, e, 1);
+
+            mpdm_mutex_lock(mpdm_aget(f, 1));
+            mpdm_aset(f, p, 4);
+            mpdm_mutex_unlock(mpdm_aget(f, 1));
+        }
+
+        if (!chan_wait(d, e))
+            task_ready(m);
+        else
+        if (f != NULL && fut_ready(f, NULL) && chan_unwait(d, e))
+            /* cancelled meanwhile: the worker finishes it */
+            task_ready(m);
+
+        mpdm_unref(e);
+        mpdm_unref(f);
+    }
+
+    mpdm_unref(t);
+}
+
+
+/*
+    Parallel maps (array.pmap() and array.pgrep()) and folds (pforeach)
+    split the array in chunks, each one a task that calls the subroutine
+    for its elements in turn. The job is [ array, sub, type, chunk
+    results, future, chunks left, lock, keys, initial values, failed,
+    instructions left, instructions given, waiting chunks, walked
+    values ]; the last chunk to finish joins the results and sets the
+    future, that the caller waits for (NULL if a chunk failed or ran out
+    of budget). Lazy iterables are first walked by the caller into an
+    array, going on from where it was if it runs out of budget.
+
+    The chunks of a caller with an instruction budget draw from the
+    instructions it had left, and it is charged with the ones they run.
+    If it runs in slices, it gives them the rest of every slice while
+    waiting (and the chunks that ran out wait for it).
+
+    The subroutine of a fold gets the value, the key (or index) and
+    the chunk's partial results, and returns them updated; the job
+    returns the array of partial results of all chunks.
+*/
+
+enum {
+    JOB_MAP, JOB_GREP, JOB_FOLD
+};
+
+static void job_start(struct nh3_vm *m)
+/* prepares a parallel map task to call the sub for its next element */
+{
+    mpdm_t j = m->job;
+    mpdm_t k = mpdm_aget(j, 7);
+
+    m->sp = m->fp = m->cs = 0;
+
+    /* the arguments go to the stack */
+    PUSH(m, mpdm_aget(mpdm_aget(j, 0), m->job_i));
+
+    if (k != NULL)
+        PUSH(m, mpdm_aget(k, m->job_i));
+    else
+        IPUSH(m, m->job_i);
+
+    m->argc = 2;
+
+    if (mpdm_ival(mpdm_aget(j, 2)) == JOB_FOLD) {
+        mpdm_t r = mpdm_aget(mpdm_aget(j, 3), m->job_c);
+        int n;
+
+        for (n = 0; n < mpdm_size(r); n++)
+            PUSH(m, mpdm_aget(r, n));
+
+        m->argc += n;
+    }
+
+    m->pc   = mpdm_ival(mpdm_aget(j, 1));
+    m->mode = VM_TIMEOUT;
+}
+
+
+static int job_next(struct nh3_vm *m)
+/* stores the value of the sub for an element and goes for the next;
+   returns 0 if the chunk is finished */
+{
+    mpdm_t v = m->sp ? BOX(&m->stack[m->sp - 1]) : NULL;
+    mpdm_t r = mpdm_aget(m->job, 3);
+
+    switch (mpdm_ival(mpdm_aget(m->job, 2))) {
+    case JOB_MAP:
+        mpdm_push(mpdm_aget(r, m->job_c), v);
+        break;
+
+    case JOB_GREP:
+        if (nh3_is_true(v))
+            mpdm_push(mpdm_aget(r, m->job_c), mpdm_aget(mpdm_aget(m->job, 0), m->job_i));
+        break;
+
+    case JOB_FOLD:
+        if (MPDM_IS_ARRAY(v))
+            mpdm_aset(r, v, m->job_c);
+        break;
+    }
+
+    if (++m->job_i < m->job_e) {
+        job_start(m);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void job_done(struct nh3_vm *m)
+/* finishes a parallel map chunk (and the job, if it is the last one) */
+{
+    mpdm_t j = m->job;
+    mpdm_t r = NULL;
+    int n, i;
+
+    mpdm_mutex_lock(mpdm_aget(j, 6));
+
+    n = mpdm_ival(mpdm_aget(j, 5)) - 1;
+    mpdm_aset(j, MPDM_I(n), 5);
+
+    if (m->mode != VM_IDLE)
+        mpdm_aset(j, MPDM_I(1), 9);
+
+    /* give back the instructions not run */
+    if (mpdm_aget(j, 10) != NULL && m->ins < m->max_ins)
+        mpdm_aset(j, MPDM_I(mpdm_ival(mpdm_aget(j, 10)) + (int) (m->max_ins - m->ins)), 10);
+
+    mpdm_mutex_unlock(mpdm_aget(j, 6));
+
+    if (n == 0) {
+        mpdm_t c = mpdm_aget(j, 3);
+
+        /* a failed chunk fails the job */
+        if (mpdm_aget(j, 9) != NULL)
+            r = NULL;
+        else
+        if (mpdm_ival(mpdm_aget(j, 2)) == JOB_FOLD)
+            r = c;
+        else {
+            r = MPDM_A(0);
+
+            for (n = 0; n < mpdm_size(c); n++) {
+                for (i = 0; i < mpdm_size(mpdm_aget(c, n)); i++)
+                    mpdm_push(r, mpdm_aget(mpdm_aget(c, n), i));
+            }
+        }
+
+        fut_done(mpdm_aget(j, 4), r);
+    }
+}
+
+
+static int job_draw(struct nh3_vm *m)
+/* a parallel map chunk out of instructions draws more from its job,
+   or waits for its caller to give them; returns 0 if it has to finish */
+{
+    mpdm_t j = m->job;
+    int r = 0;
+
+    if (j == NULL || m->mode != VM_TIMEOUT || mpdm_aget(j, 10) == NULL ||
+        (m->max && vm_clock() > m->max))
+        return 0;
+
+    mpdm_mutex_lock(mpdm_aget(j, 6));
+
+    if (mpdm_aget(j, 9) == NULL) {
+        int n = mpdm_ival(mpdm_aget(j, 10));
+
+        if (n > 0) {
+            m->ins      = 0;
+            m->max_ins  = n < TASK_SLICE ? n : TASK_SLICE;
+            mpdm_aset(j, MPDM_I(n - m->max_ins), 10);
+            r = 1;
+        }
+        else
+        if (mpdm_aget(j, 12) != NULL) {
+            mpdm_push(mpdm_aget(j, 12), mpdm_new(0, m, 0));
+            r = 2;
+        }
+    }
+
+    mpdm_mutex_unlock(mpdm_aget(j, 6));
+
+    if (r == 1)
+        task_ready(m);
+
+    return r;
+}
+
+
+static void job_wake(mpdm_t j, int n)
+/* gives n instructions to a job and wakes up its waiting chunks */
+{
+    mpdm_t l;
+    int i;
+
+    mpdm_mutex_lock(mpdm_aget(j, 6));
+
+    mpdm_aset(j, MPDM_I(mpdm_ival(mpdm_aget(j, 10)) + n), 10);
+    l = mpdm_ref(mpdm_aget(j, 12));
+    mpdm_aset(j, MPDM_A(0), 12);
+
+    mpdm_mutex_unlock(mpdm_aget(j, 6));
+
+    for (i = 0; i < mpdm_size(l); i++) {
+        struct nh3_vm *t = (struct nh3_vm *)mpdm_aget(l, i)->data;
+
+        /* the ones that can't go on finish */
+        if (!job_draw(t))
+            task_ready(t);
+    }
+
+    mpdm_unref(l);
+}
+
+
+static void job_abandon(mpdm_t j)
+/* fails a job whose caller is gone */
+{
+    mpdm_mutex_lock(mpdm_aget(j, 6));
+    mpdm_aset(j, MPDM_I(1), 9);
+    mpdm_mutex_unlock(mpdm_aget(j, 6));
+
+    job_wake(j, 0);
+}
+
+
+static mpdm_t worker(mpdm_t c, mpdm_t a, mpdm_t ctxt)
+/* worker thread: runs tasks in slices */
+{
+    int w = mpdm_ival(c);
+
+    for (;;) {
+        struct nh3_vm *m;
+
+        mpdm_semaphore_wait(ready);
+        m = task_take(w);
+
+        /* the task belongs to this worker from now on, and
+           runs a slice of its budget */
+        m->task     = w + 1;
+        m->pause    = m->ins + TASK_SLICE;
+
+        /* a future with a value before finishing was cancelled */
+        if (m->done != NULL && fut_ready(m->done, NULL))
+            m->mode = VM_IDLE;
+        else
+            exec_vm(m);
+
+        /* parallel map tasks go on with their next element */
+        while (m->job != NULL && m->mode == VM_IDLE && job_next(m))
+            exec_vm(m);
+
+        if (m->mode == VM_TIMEOUT && !vm_spent(m))
+            task_ready(m);
+        else
+        if (m->mode == VM_WAITING)
+            task_park(m);
+        else
+        if (!job_draw(m)) {
+            if (m->job != NULL)
+                job_done(m);
+            else
+                /* the return value (or NULL, on error or timeout) */
+                fut_done(m->done, m->mode == VM_IDLE && m->sp ? BOX(&m->stack[m->sp - 1]) : NULL);
+
+            free_vm(m);
+        }
+    }
+
+    return NULL;
+}
+
+
+static mpdm_t timer(mpdm_t c, mpdm_t a, mpdm_t ctxt)
+/* timer thread: wakes up the sleeping tasks */
+{
+    for (;;) {
+        struct nh3_vm **p, *m;
+        long long now;
+        int idle;
+
+        mpdm_mutex_lock(sched_mutex);
+
+        sched_ticks++;
+        now = sched_clock();
+
+        for (p = &sleepers; (m = *p) != NULL;) {
+            if (m->sleep <= now) {
+                *p = m->next;
+                task_ready(m);
+            }
+            else
+                p = &m->next;
+        }
+
+        idle = (sleepers == NULL);
+
+        mpdm_mutex_unlock(sched_mutex);
+
+        if (idle)
+            mpdm_semaphore_wait(sched_alarm);
+        else
+            mpdm_sleep(1);
+    }
+
+    return NULL;
+}
+
+
+static int task_workers(void)
+/* returns the number of workers to start: one per processor */
+{
+    long n = 0;
+
+#ifdef CONFOPT_SYSCONF
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    if (n < 1)
+        n = 4;
+
+    return n > MAX_WORKERS ? MAX_WORKERS : (int) n;
+}
+
+
+static int task_worker(struct nh3_vm *m)
+/* returns the worker for a task spawned from m (starting them if needed) */
+{
+    int n;
+
+    /* tasks spawn to their own worker */
+    if (m->task)
+        return m->task;
+
+    mpdm_mutex_lock(sched_mutex);
+
+    if (workers == 0) {
+        int w = task_workers();
+
+        for (n = 0; n < w; n++)
+            runq[n].mutex = mpdm_ref(mpdm_new_mutex());
+
+        workers = w;
+
+        for (n = 0; n < w; n++)
+            mpdm_void(mpdm_exec_thread(MPDM_X2(worker, MPDM_I(n)), NULL, NULL));
+
+        mpdm_void(mpdm_exec_thread(MPDM_X2(timer, NULL), NULL, NULL));
+    }
+
+    /* spread the others */
+    n = spawns++ % workers + 1;
+
+    mpdm_mutex_unlock(sched_mutex);
+
+    return n;
+}
+
+
+static mpdm_t chan_read(mpdm_t d, mpdm_t a, mpdm_t ctxt)
+/* reads a value from a channel: the VM takes it (or waits for it) */
+{
+    return nh3_park(d, 0);
+}
+
+
+static mpdm_t chan_write(mpdm_t d, mpdm_t a, mpdm_t ctxt)
+/* writes values to a channel */
+{
+    int n;
+
+    for (n = 0; n < mpdm_size(a); n++)
+        chan_put(d, mpdm_aget(a, n));
+
+    return MPDM_I(n);
+}
+
+
+static mpdm_t chan_end(mpdm_t in, mpdm_t out)
+/* creates a channel end: { read: ..., write: ... } */
+{
+    mpdm_t h = MPDM_H(0);
+
+    mpdm_hset_s(h, L"read",     MPDM_X2(chan_read, in));
+    mpdm_hset_s(h, L"write",    MPDM_X2(chan_write, out));
+
+    return h;
+}
+
+
+static mpdm_t fut_wait(mpdm_t f, mpdm_t a, mpdm_t ctxt)
+/* task.wait(): returns the return value of a task, waiting for it */
+{
+    mpdm_t v;
+
+    return fut_ready(f, &v) ? v : nh3_park(f, 1);
+}
+
+
+static mpdm_t fut_cancel(mpdm_t f, mpdm_t a, mpdm_t ctxt)
+/* task.cancel(): cancels a task; waiting for it returns NULL */
+{
+    mpdm_t p;
+
+    fut_done(f, NULL);
+
+    /* a task parked on a channel is taken out and freed
+       (any other finishes when a worker takes it) */
+    mpdm_mutex_lock(mpdm_aget(f, 1));
+    p = mpdm_ref(mpdm_aget(f, 4));
+    mpdm_mutex_unlock(mpdm_aget(f, 1));
+
+    if (p != NULL && chan_unwait(mpdm_aget(p, 0), mpdm_aget(p, 1)))
+        free_vm((struct nh3_vm *)mpdm_aget(p, 1)->data);
+
+    mpdm_unref(p);
+
+    return NULL;
+}
+
+
+static mpdm_t wait_any(mpdm_t w, mpdm_t a, mpdm_t ctxt)
+/* waits for any of a list of tasks whose futures signal a channel
+   ([ list, channel ]); the channel is removed from them at the end */
+{
+    mpdm_t l = mpdm_aget(w, 0);
+    mpdm_t r = NULL;
+    int n;
+
+    for (n = 0; n < mpdm_size(l) && r == NULL; n++) {
+        if (fut_ready(mpdm_hget_s(mpdm_aget(l, n), L"future"), NULL))
+            r = mpdm_aget(l, n);
+    }
+
+    if (r != NULL) {
+        for (n = 0; n < mpdm_size(l); n++)
+            fut_unlisten(mpdm_hget_s(mpdm_aget(l, n), L"future"), mpdm_aget(w, 1));
+    }
+    else {
+        /* retried as a call to this (not to register again) */
+        r = nh3_park(mpdm_aget(w, 1), 1);
+        mpdm_push(r, NULL);
+        mpdm_push(r, NULL);
+        mpdm_push(r, MPDM_X2(wait_any, w));
+    }
+
+    return r;
+}
+
+
+mpdm_t nh3_wait(mpdm_t l, int all)
+/* waits for all (returning their values) or any (returning it) of a list of tasks */
+{
+    mpdm_t r = NULL;
+    mpdm_t w;
+    int n;
+
+    for (n = 0; n < mpdm_size(l); n++) {
+        mpdm_t f = mpdm_hget_s(mpdm_aget(l, n), L"future");
+
+        if (fut_ready(f, NULL) != all)
+            return all ? nh3_park(f, 1) : mpdm_aget(l, n);
+    }
+
+    if (all) {
+        r = MPDM_A(mpdm_size(l));
+
+        for (n = 0; n < mpdm_size(l); n++) {
+            mpdm_t v;
+
+            fut_ready(mpdm_hget_s(mpdm_aget(l, n), L"future"), &v);
+            mpdm_aset(r, v, n);
+        }
+    }
+    else
+    if (mpdm_size(l)) {
+        /* none finished: wait for a signal from any of them */
+        w = mpdm_ref(MPDM_A(2));
+
+        mpdm_aset(w, l, 0);
+        mpdm_aset(w, chan_new(), 1);
+
+        for (n = 0; n < mpdm_size(l); n++)
+            fut_listen(mpdm_hget_s(mpdm_aget(l, n), L"future"), mpdm_aget(w, 1));
+
+        r = wait_any(w, NULL, NULL);
+
+        mpdm_unref(w);
+    }
+
+    return r;
+}
+
+
+static mpdm_t job_new(mpdm_t a, mpdm_t f, int type)
+/* returns a token for the VM to spawn a parallel map job */
+{
+    mpdm_t j = MPDM_A(14);
+    mpdm_t r = nh3_park(NULL, 0);
+
+    mpdm_aset(j, a, 0);
+    mpdm_aset(j, f, 1);
+    mpdm_aset(j, MPDM_I(type), 2);
+
+    mpdm_push(r, j);
 
-    /* local symtable */
-    for (n = m->tt - 1; n >= 0; n--) {
-        /* try down the list and short-circuit on NULL values,
-           jumping down to 0 (global symtable) */
-        if (
-                (l = mpdm_aget(m->symtbl, n)) ||
-                (l = mpdm_aget(m->symtbl, (n = 0)))
-            ) {
-            if (mpdm_exists(l, s))
-                break;
+    return r;
+}
+
+
+mpdm_t nh3_pmap(mpdm_t a, mpdm_t f, int grep)
+/* maps (or greps) an array through a subroutine, in parallel */
+{
+    mpdm_t r, x;
+    int n;
+
+    if (mpdm_size(a) && !MPDM_IS_EXEC(f))
+        r = job_new(a, f, grep ? JOB_GREP : JOB_MAP);
+    else {
+        /* native functions are called here */
+        r = MPDM_A(0);
+        x = mpdm_ref(MPDM_A(2));
+
+        for (n = 0; n < mpdm_size(a); n++) {
+            mpdm_t v;
+
+            mpdm_aset(x, mpdm_aget(a, n), 0);
+            mpdm_aset(x, MPDM_I(n), 1);
+
+            v = mpdm_exec(f, x, NULL);
+
+            if (!grep)
+                mpdm_push(r, v);
+            else
+            if (nh3_is_true(v))
+                mpdm_push(r, mpdm_aget(a, n));
+            else
+                mpdm_void(v);
         }
+
+        mpdm_unref(x);
     }
 
-    if (n < 0) {
-        mpdm_t v = mpdm_aget(m->symtbl, m->tt - 1);
-        l = NULL;
+    return r;
+}
 
-        /* still not found? try on the type-specific tables */
-        v = mpdm_hget_s(mpdm_root(), nh3_type(v));
 
-        if (mpdm_exists(v, s))
-            l = v;
+static mpdm_t pfold(mpdm_t a, mpdm_t ctxt)
+/* folds an array, hash or count through a subroutine, in parallel (pforeach) */
+{
+    mpdm_t v = mpdm_ref(mpdm_aget(a, 0));
+    mpdm_t r, k = NULL;
+    int n;
+
+    if (MPDM_IS_HASH(v)) {
+        /* iterate the values, giving the keys */
+        k = mpdm_ref(mpdm_keys(v));
+        r = MPDM_A(mpdm_size(k));
+
+        for (n = 0; n < mpdm_size(k); n++)
+            mpdm_aset(r, mpdm_hget(v, mpdm_aget(k, n)), n);
+
+        mpdm_set(&v, r);
     }
+    else
+    if (IS_NUM(v) && !MPDM_IS_ARRAY(v)) {
+        /* counts iterate from 0 to n - 1 */
+        r = MPDM_A(0);
 
-    if (l == NULL)
-        vm_error(m, MPDM_LS(L"undefined symbol "), s);
-    else {
-        PUSH(m, l);
-        PUSH(m, s);
+        for (n = 0; n < mpdm_ival(v); n++)
+            mpdm_push(r, MPDM_I(n));
+
+        mpdm_set(&v, r);
     }
 
-    mpdm_unref(s);
+    /* lazy iterables are walked by the VM (see job_spawn()) */
+    if (MPDM_IS_EXEC(v) || mpdm_size(v)) {
+        r = job_new(v, mpdm_aget(a, 1), JOB_FOLD);
 
-    return l;
+        mpdm_aset(mpdm_aget(r, 3), k, 7);
+        mpdm_aset(mpdm_aget(r, 3), mpdm_aget(a, 2), 8);
+    }
+    else
+        r = MPDM_A(0);
+
+    mpdm_unref(k);
+    mpdm_unref(v);
+
+    return r;
 }
 
 
-static void ARG(struct nh3_vm *m)
+static mpdm_t job_wait(mpdm_t j, mpdm_t a, mpdm_t ctxt)
+/* returns a token for the VM to wait for a spawned job */
 {
-    mpdm_t h, k, v;
-    int n;
+    mpdm_t r = nh3_park(NULL, 0);
 
-    h = mpdm_aset(m->symtbl, MPDM_H(0), m->tt++); 
-    k = POP(m);
-    v = POP(m);
+    mpdm_push(r, j);
 
-    for (n = 0; n < mpdm_size(k); n++)
-        mpdm_hset(h, mpdm_aget(k, n), mpdm_aget(v, n));
+    return r;
 }
 
 
-int nh3_is_true(mpdm_t v)
+static int job_join(struct nh3_vm *m, mpdm_t j)
+/* pushes the result of a finished job, charging the caller with the
+   instructions its chunks ran; returns 0 if it is not finished (a
+   caller run in slices gives it the rest of the slice) */
 {
-    /* if value is NULL, it's false */
-    if (v == NULL)
-        return 0;
+    mpdm_t v;
+    int n;
 
-    /* if it's a printable string... */
-    if (v->flags & MPDM_STRING) {
-        wchar_t *ptr = mpdm_string(v);
+    if (fut_ready(mpdm_aget(j, 4), &v)) {
+        /* all chunks are done: no need to lock */
+        if (mpdm_aget(j, 10) != NULL &&
+            (n = mpdm_ival(mpdm_aget(j, 11)) - mpdm_ival(mpdm_aget(j, 10))) > 0)
+            m->ins += n;
 
-        /* ... and it's "" or the "0" string, it's false */
-        if (*ptr == L'\0' || (*ptr == L'0' && *(ptr + 1) == L'\0'))
-            return 0;
+        PUSH(m, v);
+        mpdm_set(&m->joined, NULL);
+
+        return 1;
     }
 
-    /* any other case is true */
-    return 1;
+    if (mpdm_aget(j, 12) != NULL) {
+        vm_account(m);
+
+        if (m->ins < m->max_ins) {
+            job_wake(j, (int) (m->max_ins - m->ins));
+            m->ins = m->max_ins;
+        }
+    }
+
+    return 0;
 }
 
 
-#define IPOP(m) mpdm_ival(POP(m))
-#define RPOP(m) mpdm_rval(POP(m))
-#define ISTRU(v) nh3_is_true(v)
-#define BOOL(i) MPDM_I(i)
-#define R(v) mpdm_rval(v)
+static void job_spawn(struct nh3_vm *m, mpdm_t j)
+/* spawns the chunks of a parallel map and calls job_wait() */
+{
+    mpdm_t a = mpdm_aget(j, 0);
+    int n, w, c, s, i, b = 0;
+
+    if (MPDM_IS_EXEC(a)) {
+        /* lazy iterables are walked to be split in chunks,
+           on the budget of the caller */
+        mpdm_t k, v, r;
 
-static int exec_vm(struct nh3_vm *m);
+        if ((r = mpdm_aget(j, 13)) == NULL) {
+            r = MPDM_A(0);
+            mpdm_aset(j, r, 13);
+        }
 
-static mpdm_t exec_vm_a0(mpdm_t c, mpdm_t a, mpdm_t ctxt)
+        n = mpdm_size(r);
+
+        while ((c = iterate(m, a, &n, &k, &v)) > 0) {
+            mpdm_void(k);
+            mpdm_push(r, v);
+        }
+
+        if (c < 0) {
+            /* out of budget: go on from here when resumed */
+            m->sp  += m->argc;
+            m->pc   = m->call;
+            PUSH(m, MPDM_X2(job_wait, j));
+            return;
+        }
+
+        mpdm_aset(j, r, 0);
+        mpdm_aset(j, NULL, 13);
+
+        if (n == 0) {
+            /* nothing to fold */
+            PUSH(m, MPDM_A(0));
+            return;
+        }
+    }
+
+    n = mpdm_size(mpdm_aget(j, 0));
+    w = task_worker(m) - 1;
+
+    /* a few chunks per worker, to even their load */
+    if ((c = workers * 4) > n)
+        c = n;
+
+    s = (n + c - 1) / c;
+    c = (n + s - 1) / s;
+
+    mpdm_aset(j, MPDM_A(c), 3);
+    mpdm_aset(j, fut_new(), 4);
+    mpdm_aset(j, MPDM_I(c), 5);
+    mpdm_aset(j, mpdm_new_mutex(), 6);
+
+    if (m->max_ins) {
+        /* the chunks share the instructions left to the caller */
+        vm_account(m);
+
+        b = m->ins < m->max_ins ? (int) (m->max_ins - m->ins) : 0;
+
+        mpdm_aset(j, MPDM_I(b % c), 10);
+        mpdm_aset(j, MPDM_I(b), 11);
+
+        if ((b /= c) == 0)
+            b = 1;
+
+        if (m->resumable) {
+            mpdm_aset(j, MPDM_A(0), 12);
+            mpdm_set(&m->joined, j);
+        }
+    }
+
+    while (c--) {
+        struct nh3_vm *t = new_vm(m->prg);
+
+        /* folds start from the initial values */
+        mpdm_aset(mpdm_aget(j, 3), mpdm_ival(mpdm_aget(j, 2)) == JOB_FOLD ?
+            mpdm_clone(mpdm_aget(j, 8)) : MPDM_A(0), c);
+
+        mpdm_set(&t->job, j);
+
+        /* chunks see the symbol tables of the caller, as the locals
+           of its subroutine that a pforeach body uses live there */
+        for (i = 1; i < m->tt; i++)
+            mpdm_aset(t->symtbl, mpdm_aget(m->symtbl, i), i);
+
+        t->tt    = m->tt;
+        t->job_c = c;
+        t->job_i = c * s;
+        t->job_e = t->job_i + s > n ? n : t->job_i + s;
+
+        vm_limit(t, m);
+        t->max_ins = b;
+
+        job_start(t);
+
+        t->task = (w + c) % workers + 1;
+        task_ready(t);
+    }
+
+    /* the call is replaced by one to wait for the job */
+    m->sp  += m->argc;
+    m->pc   = m->call;
+    PUSH(m, MPDM_X2(job_wait, j));
+}
+
+
+static void PRK(struct nh3_vm *m, mpdm_t t)
+/* handles the park token returned by a native call */
 {
-    mpdm_t r = NULL;
-    struct nh3_vm m;
-    int n;
+    mpdm_t d = mpdm_aget(t, 1);
 
-    memset(&m, '\0', sizeof(m));
-    reset_vm(&m, c);
+    mpdm_ref(t);
 
-    /* set program counter */
-    m.pc = mpdm_ival(mpdm_aget(a, 0));
+    if (mpdm_aget(t, 4) != NULL) {
+        mpdm_t v = gen_run(m, mpdm_aget(t, 4));
 
-    /* push the rest of arguments to the stack */
-    for (n = 1; n < mpdm_size(a); n++)
-        PUSH(&m, mpdm_aget(a, n));
+        if (m->mode == VM_TIMEOUT) {
+            /* call again when resumed */
+            m->sp  += m->argc + 1;
+            m->pc   = m->call;
+        }
+        else
+            /* the end mark is only for iterators */
+            PUSH(m, v == end_mark ? NULL : v);
+    }
+    else
+    if (mpdm_aget(t, 3) != NULL) {
+        mpdm_t j = mpdm_aget(t, 3);
+
+        /* jobs are spawned on the first call, then waited for */
+        if (mpdm_aget(j, 4) == NULL)
+            job_spawn(m, j);
+        else
+        if (!job_join(m, j))
+            PRK(m, nh3_park(mpdm_aget(j, 4), 1));
+    }
+    else
+    if (d == NULL) {
+        PUSH(m, NULL);
+
+        if (m->task) {
+            mpdm_set(&m->wait, t);
+            m->mode = VM_WAITING;
+        }
+        else
+            mpdm_sleep(mpdm_ival(mpdm_aget(t, 2)));
+    }
+    else
+    if (mpdm_ival(mpdm_aget(t, 2)) || !chan_take(d, m)) {
+        /* call again when the channel has values: the function
+           and its arguments are still in their (popped) slots */
+        m->sp  += m->argc + 1;
+        m->pc   = m->call;
+
+        /* (or to the function the token gives instead) */
+        if (mpdm_aget(t, 5) != NULL) {
+            m->sp--;
+            PUSH(m, mpdm_aget(t, 5));
+        }
+
+        if (m->task) {
+            mpdm_set(&m->wait, t);
+            m->mode = VM_WAITING;
+        }
+        else
+        if (m->max) {
+            /* not a task, but with a deadline: poll until it passes */
+            while (!vm_spent(m) && chan_empty(d))
+                mpdm_sleep(1);
+
+            if (vm_spent(m))
+                m->mode = VM_TIMEOUT;
+        }
+        else
+        if (m->resumable && m->max_ins)
+            /* run in slices: as waiting runs no instructions,
+               stop here, to be called again when resumed */
+            m->mode = VM_TIMEOUT;
+        else {
+            /* not a task: block the thread */
+            mpdm_t e = mpdm_ref(mpdm_new(0, m, 0));
 
-    r = MPDM_I(exec_vm(&m));
+            if (m->sem == NULL)
+                m->sem = mpdm_ref(mpdm_new_semaphore(0));
 
-    reset_vm(&m, NULL);
+            while (chan_wait(d, e))
+                mpdm_semaphore_wait(m->sem);
 
-    return r;
+            mpdm_unref(e);
+        }
+    }
+
+    mpdm_unref(t);
 }
 
 
 static void FRK(struct nh3_vm *m)
 {
-    mpdm_t p, c, a, b, x;
+    struct nh3_vm *t = new_vm(m->prg);
+    mpdm_t d1 = chan_new();
+    mpdm_t d2 = chan_new();
+    mpdm_t h;
 
-    mpdm_new_channel(&p, &c);
+    t->pc = IVAL(SPOP(m));
+
+    /* the task gets the child end as its argument */
+    PUSH(t, chan_end(d1, d2));
+    t->argc = 1;
+
+    /* the spawner gets the parent end, that is also the task handle */
+    h = PUSH(m, chan_end(d2, d1));
+    mpdm_set(&t->done, fut_new());
+
+    mpdm_hset_s(h, L"future",   t->done);
+    mpdm_hset_s(h, L"wait",     MPDM_X2(fut_wait, t->done));
+    mpdm_hset_s(h, L"cancel",   MPDM_X2(fut_cancel, t->done));
+
+    vm_limit(t, m);
+    t->mode = VM_TIMEOUT;
+    t->task = task_worker(m);
+    task_ready(t);
+}
+
+
+static void XCL(struct nh3_vm *m, mpdm_t x, mpdm_t a)
+/* calls a native function */
+{
+    mpdm_t w = mpdm_exec(x, a, mpdm_aget(m->symtbl, m->tt - 1));
+
+    if (MPDM_IS_ARRAY(w) && mpdm_aget(w, 0) == park_mark)
+        PRK(m, w);
+    else
+        PUSH(m, w);
+}
+
+
+static void XCN(struct nh3_vm *m, mpdm_t x, int n)
+/* calls a native function with the n arguments on the stack
+   (from a 2 word instruction) */
+{
+    mpdm_t a = MPDM_A(n);
+    int i;
+
+    /* natives get the arguments as an array */
+    for (i = 0; i < n; i++)
+        mpdm_aset(a, BOX(&m->stack[m->sp - n + i]), i);
+
+    m->sp  -= n;
+    m->argc = n;
+    m->call = m->pc - 2;
+
+    XCL(m, x, a);
+}
+
+
+static void CALL(struct nh3_vm *m, int pc)
+/* calls the subroutine at pc, with its arguments on the stack */
+{
+    if (m->cs + 3 > m->c_stack_i)
+        grow_c_stack(m, m->c_stack_i * 2);
+
+    m->c_stack[m->cs++] = m->pc;
+    m->c_stack[m->cs++] = m->fp;
+    m->c_stack[m->cs++] = m->tt;
+    m->pc = pc;
+
+    VM_CHECK();
+}
 
-    /* a = [ spawn_func_addr, [ child_channel ] ] ; */
-    a = mpdm_ref(MPDM_A(0));
-    mpdm_push(a, POP(m));
-    b = mpdm_push(a, MPDM_A(0));
-    mpdm_push(b, c);
 
-    PUSH(m, p);
+static int TCL(struct nh3_vm *m, int n)
+/* moves the n arguments on the stack to the frame of the running
+   subroutine, to be reused by a call in tail position; returns 0
+   if it cannot be done (no caller, the frame has a symbol table
+   with names or something was pushed over it, like the object of
+   a method call or an iterator) */
+{
+    int b, i;
+
+    if (m->cs == 0 || m->tt != (b = m->c_stack[m->cs - 1]) + 1 ||
+        mpdm_aget(m->symtbl, b) != m->frame)
+        return 0;
+
+    for (i = 0; i < n; i++)
+        SSET(&m->stack[m->fp + i], &m->stack[m->sp - n + i]);
 
-    x = MPDM_X2(exec_vm_a0, m->prg);
+    m->sp   = m->fp + n;
+    m->argc = n;
+    m->tt   = b;
 
-    mpdm_void(mpdm_exec_thread(x, mpdm_unrefnd(a), NULL));
+    return 1;
 }
 
 
 static int exec_vm(struct nh3_vm *m)
 {
-    clock_t max;
     mpdm_t v, w, h;
+    struct nh3_val *k;
     double r1, r2;
     int i1, i2;
 
-    /* maximum running time */
-    max = m->msecs ? (clock() + (m->msecs * CLOCKS_PER_SEC) / 1000) : 0;
+#ifdef CONFOPT_COMPUTED_GOTO
+    static void *labels[] = {
+        [OP_EOP] = &&L_OP_EOP, [OP_LIT] = &&L_OP_LIT, [OP_NUL] = &&L_OP_NUL,
+        [OP_ARR] = &&L_OP_ARR, [OP_HSH] = &&L_OP_HSH, [OP_POP] = &&L_OP_POP,
+        [OP_SWP] = &&L_OP_SWP, [OP_DUP] = &&L_OP_DUP, [OP_DP2] = &&L_OP_DP2,
+        [OP_DPN] = &&L_OP_DPN, [OP_GET] = &&L_OP_GET, [OP_SET] = &&L_OP_SET,
+        [OP_STI] = &&L_OP_STI, [OP_APU] = &&L_OP_APU, [OP_TBL] = &&L_OP_TBL,
+        [OP_TPU] = &&L_OP_TPU, [OP_TPO] = &&L_OP_TPO, [OP_TLT] = &&L_OP_TLT,
+        [OP_THS] = &&L_OP_THS, [OP_CAL] = &&L_OP_CAL, [OP_RET] = &&L_OP_RET,
+        [OP_ARG] = &&L_OP_ARG, [OP_JMP] = &&L_OP_JMP, [OP_JF] = &&L_OP_JF,
+        [OP_AND] = &&L_OP_AND, [OP_OR] = &&L_OP_OR, [OP_XOR] = &&L_OP_XOR,
+        [OP_SHL] = &&L_OP_SHL, [OP_SHR] = &&L_OP_SHR, [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB, [OP_MUL] = &&L_OP_MUL, [OP_DIV] = &&L_OP_DIV,
+        [OP_MOD] = &&L_OP_MOD, [OP_NOT] = &&L_OP_NOT, [OP_EQ] = &&L_OP_EQ,
+        [OP_GT] = &&L_OP_GT, [OP_GE] = &&L_OP_GE, [OP_LT] = &&L_OP_LT,
+        [OP_LE] = &&L_OP_LE, [OP_REM] = &&L_OP_REM, [OP_CAT] = &&L_OP_CAT,
+        [OP_ITE] = &&L_OP_ITE, [OP_FMT] = &&L_OP_FMT, [OP_FRK] = &&L_OP_FRK,
+        [OP_ENT] = &&L_OP_ENT, [OP_LDL] = &&L_OP_LDL, [OP_STL] = &&L_OP_STL,
+        [OP_JT] = &&L_OP_JT, [OP_NE] = &&L_OP_NE, [OP_NEG] = &&L_OP_NEG,
+        [OP_INC] = &&L_OP_INC, [OP_DEC] = &&L_OP_DEC, [OP_ADL] = &&L_OP_ADL,
+        [OP_SBL] = &&L_OP_SBL, [OP_GMS] = &&L_OP_GMS, [OP_JEQ] = &&L_OP_JEQ,
+        [OP_JNE] = &&L_OP_JNE, [OP_JGT] = &&L_OP_JGT, [OP_JGE] = &&L_OP_JGE,
+        [OP_JLT] = &&L_OP_JLT, [OP_JLE] = &&L_OP_JLE, [OP_CLN] = &&L_OP_CLN,
+        [OP_FRM] = &&L_OP_FRM, [OP_TCL] = &&L_OP_TCL, [OP_ITS] = &&L_OP_ITS,
+        [OP_GEN] = &&L_OP_GEN, [OP_YLD] = &&L_OP_YLD, [OP_GTL] = &&L_OP_GTL,
+        [OP_NOP] = &&L_OP_NOP,
+    };
+#endif
 
     /* start running if there is no error */
     if (m->mode != VM_ERROR)
         m->mode = VM_RUNNING;
 
-    m->ins = 0;
+    /* go on with the budget left */
+    m->tick = m->slice = 0;
+    vm_budget(m);
+
+    VM_START;
+        OP(OP_NOP): NEXT;
+        OP(OP_EOP): m->mode = VM_IDLE; NEXT;
+        OP(OP_LIT): v = mpdm_aget(m->pool, PC(m)); if (MPDM_IS_ARRAY(v)) LPUSH(m, v); else PUSH(m, v); NEXT;
+        OP(OP_NUL): PUSH(m, NULL); NEXT;
+        OP(OP_ARR): PUSH(m, MPDM_A(0)); NEXT;
+        OP(OP_HSH): PUSH(m, MPDM_H(0)); NEXT;
+        OP(OP_POP): --m->sp; NEXT;
+        OP(OP_SWP): { struct nh3_val t = m->stack[m->sp - 1];
+            m->stack[m->sp - 1] = m->stack[m->sp - 2]; m->stack[m->sp - 2] = t; } NEXT;
+        OP(OP_DUP): SPUSH(m, m->stack[m->sp - 1]); NEXT;
+        OP(OP_DP2): SPUSH(m, m->stack[m->sp - 2]); NEXT;
+        OP(OP_DPN): i1 = PC(m); SPUSH(m, m->stack[m->sp - i1]); NEXT;
+        OP(OP_TBL): TBL(m, PC(m)); NEXT;
+        OP(OP_GET): k = SPOP(m); i1 = m->stack[m->sp - 1].type; v = PEEK(SPOP(m));
+            if (i1 == V_LIT) LPUSH(m, GET(m, v, k)); else PUSH(m, GET(m, v, k)); NEXT;
+        OP(OP_SET): w = POP(m); k = SPOP(m); PUSH(m, SET(m, POP(m), k, w)); NEXT;
+        OP(OP_STI): w = POP(m); k = SPOP(m); SET(m, TOS(m), k, w); NEXT;
+        OP(OP_APU): v = POP(m); mpdm_push(TOS(m), v); NEXT;
+        OP(OP_TPU): v = POP(m);
+            /* a hash with keys can shadow cached symbols */
+            if (MPDM_IS_HASH(v) && v != mpdm_aget(m->symtbl, m->tt))
+                m->stamp++;
+            mpdm_aset(m->symtbl, v, m->tt++); NEXT;
+        OP(OP_TPO): --m->tt; NEXT;
+        OP(OP_TLT): PUSH(m, mpdm_aget(m->symtbl, m->tt - 1)); NEXT;
+        OP(OP_THS): PUSH(m, mpdm_aget(m->symtbl, m->tt - 2)); NEXT;
+        OP(OP_ARG): ARG(m, PC(m)); NEXT;
+        OP(OP_ENT): ENT(m, PC(m), 0); NEXT;
+        OP(OP_LDL): k = &m->stack[m->fp + PC(m)];
+            if (k->type == V_LIT) BOX(k);
+            SPUSH(m, *k); NEXT;
+        OP(OP_STL): SSET(&m->stack[m->fp + PC(m)], &m->stack[m->sp - 1]); NEXT;
+        OP(OP_GTL): GTL(m, PC(m)); NEXT;
+        OP(OP_INC): IPUSH(m, 1); ISL(m, PC(m), OP_ADD); NEXT;
+        OP(OP_DEC): IPUSH(m, 1); ISL(m, PC(m), OP_SUB); NEXT;
+        OP(OP_ADL): ISL(m, PC(m), OP_ADD); NEXT;
+        OP(OP_SBL): ISL(m, PC(m), OP_SUB); NEXT;
+        OP(OP_GMS): GMS(m, PC(m)); NEXT;
+        OP(OP_JMP): JUMP(m); NEXT;
+        OP(OP_JF):  if (!ISTRU(SPOP(m))) JUMP(m); else m->pc++; NEXT;
+        OP(OP_JT):  if (ISTRU(SPOP(m))) JUMP(m); else m->pc++; NEXT;
+        OP(OP_JEQ): k = SPOP(m); if (EQ(SPOP(m), k)) m->pc++; else JUMP(m); NEXT;
+        OP(OP_JNE): k = SPOP(m); if (!EQ(SPOP(m), k)) m->pc++; else JUMP(m); NEXT;
+        OP(OP_JGT): JCMP(m, >);  NEXT;
+        OP(OP_JGE): JCMP(m, >=); NEXT;
+        OP(OP_JLT): JCMP(m, <);  NEXT;
+        OP(OP_JLE): JCMP(m, <=); NEXT;
+        OP(OP_ADD): ARITH(m, +); NEXT;
+        OP(OP_SUB): ARITH(m, -); NEXT;
+        OP(OP_MUL): ARITH(m, *); NEXT;
+        OP(OP_DIV): r2 = RPOP(m); r1 = RPOP(m); RPUSH(m, r1 / r2); NEXT;
+        OP(OP_MOD): i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 % i2); NEXT;
+        OP(OP_NOT): IPUSH(m, !ISTRU(SPOP(m))); NEXT;
+        OP(OP_EQ):  k = SPOP(m); IPUSH(m, EQ(SPOP(m), k)); NEXT;
+        OP(OP_NE):  k = SPOP(m); IPUSH(m, !EQ(SPOP(m), k)); NEXT;
+        OP(OP_NEG): if (NUM(k = SPOP(m), &i1, &r1) && i1 != INT_MIN) IPUSH(m, -i1); else RPUSH(m, -r1); NEXT;
+        OP(OP_GT):  CMP(m, >);  NEXT;
+        OP(OP_GE):  CMP(m, >=); NEXT;
+        OP(OP_LT):  CMP(m, <);  NEXT;
+        OP(OP_LE):  CMP(m, <=); NEXT;
+        OP(OP_AND): i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 &  i2); NEXT;
+        OP(OP_OR):  i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 |  i2); NEXT;
+        OP(OP_XOR): i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 ^  i2); NEXT;
+        OP(OP_SHL): i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 << i2); NEXT;
+        OP(OP_SHR): i2 = IPOP(m); i1 = IPOP(m); IPUSH(m, i1 >> i2); NEXT;
+        OP(OP_CAT): w = POP(m); v = POP(m); PUSH(m, mpdm_join(v, w)); NEXT;
+        OP(OP_FMT): w = POP(m); v = POP(m); PUSH(m, mpdm_fmt(v, w)); NEXT;
+        OP(OP_REM): m->pc++; NEXT;
+        OP(OP_CAL): v = POP(m);
+            if (MPDM_IS_EXEC(v)) {
+                m->argc = 1;
+                m->call = m->pc - 1;
+                XCL(m, v, POP(m));
+            }
+            else {
+                /* the arguments are spread on the stack */
+                i1 = mpdm_ival(v);
+                w  = mpdm_ref(POP(m));
 
-    while (m->mode == VM_RUNNING) {
-
-        /* get the opcode */
-        nh3_op_t opcode = mpdm_ival(PC(m));
-    
-        switch (opcode) {
-        case OP_NOP: break;
-        case OP_EOP: m->mode = VM_IDLE; break;
-        case OP_LIT: PUSH(m, mpdm_clone(PC(m))); break;
-        case OP_NUL: PUSH(m, NULL); break;
-        case OP_ARR: PUSH(m, MPDM_A(0)); break;
-        case OP_HSH: PUSH(m, MPDM_H(0)); break;
-        case OP_POP: --m->sp; break;
-        case OP_SWP: v = POP(m); w = RF(POP(m)); PUSH(m, v); UF(PUSH(m, w)); break;
-        case OP_DUP: PUSH(m, TOS(m)); break;
-        case OP_DP2: PUSH(m, mpdm_aget(m->stack, m->sp - 2)); break;
-        case OP_DPN: PUSH(m, mpdm_aget(m->stack, m->sp - mpdm_ival(PC(m)))); break;
-        case OP_TBL: TBL(m); break;
-        case OP_GET: w = POP(m); v = POP(m); PUSH(m, GET(m, v, w)); break;
-        case OP_SET: w = POP(m); v = POP(m); PUSH(m, SET(m, POP(m), v, w)); break;
-        case OP_STI: w = POP(m); v = POP(m); SET(m, TOS(m), v, w); break;
-        case OP_APU: v = POP(m); mpdm_push(TOS(m), v); break;
-        case OP_TPU: mpdm_aset(m->symtbl, POP(m), m->tt++); break;
-        case OP_TPO: --m->tt; break;
-        case OP_TLT: PUSH(m, mpdm_aget(m->symtbl, m->tt - 1)); break;
-        case OP_THS: PUSH(m, mpdm_aget(m->symtbl, m->tt - 2)); break;
-        case OP_ARG: ARG(m); break;
-        case OP_JMP: m->pc = mpdm_ival(PC(m)); break;
-        case OP_JF:  if (!ISTRU(POP(m))) m->pc = mpdm_ival(PC(m)); else m->pc++; break;
-        case OP_ADD: r2 = RPOP(m); r1 = RPOP(m); PUSH(m, MPDM_R(r1 + r2)); break;
-        case OP_SUB: r2 = RPOP(m); r1 = RPOP(m); PUSH(m, MPDM_R(r1 - r2)); break;
-        case OP_MUL: r2 = RPOP(m); r1 = RPOP(m); PUSH(m, MPDM_R(r1 * r2)); break;
-        case OP_DIV: r2 = RPOP(m); r1 = RPOP(m); PUSH(m, MPDM_R(r1 / r2)); break;
-        case OP_MOD: i2 = IPOP(m); i1 = IPOP(m); PUSH(m, MPDM_I(i1 % i2)); break;
-        case OP_NOT: PUSH(m, MPDM_I(!ISTRU(POP(m)))); break;
-        case OP_EQ:  v = POP(m); w = POP(m);
-             PUSH(m, BOOL((v == NULL || w == NULL) ? (v == w) : (R(v) == R(w)))); break;
-        case OP_GT:  r2 = RPOP(m); r1 = RPOP(m); PUSH(m, BOOL(r1 >  r2)); break;
-        case OP_GE:  r2 = RPOP(m); r1 = RPOP(m); PUSH(m, BOOL(r1 >= r2)); break;
-        case OP_LT:  r2 = RPOP(m); r1 = RPOP(m); PUSH(m, BOOL(r1 <  r2)); break;
-        case OP_LE:  r2 = RPOP(m); r1 = RPOP(m); PUSH(m, BOOL(r1 <= r2)); break;
-        case OP_AND: i2 = IPOP(m); i1 = IPOP(m); PUSH(m, MPDM_I(i1 &  i2)); break;
-        case OP_OR:  i2 = IPOP(m); i1 = IPOP(m); PUSH(m, MPDM_I(i1 |  i2)); break;
-        case OP_XOR: i2 = IPOP(m); i1 = IPOP(m); PUSH(m, MPDM_I(i1 ^  i2)); break;
-        case OP_SHL: i2 = IPOP(m); i1 = IPOP(m); PUSH(m, MPDM_I(i1 << i2)); break;
-        case OP_SHR: i2 = IPOP(m); i1 = IPOP(m); PUSH(m, MPDM_I(i1 >> i2)); break;
-        case OP_CAT: w = POP(m); v = POP(m); PUSH(m, mpdm_join(v, w)); break;
-        case OP_FMT: w = POP(m); v = POP(m); PUSH(m, mpdm_fmt(v, w)); break;
-        case OP_REM: m->pc++; break;
-        case OP_LNI: m->line = mpdm_ival(PC(m));
-            /* TBD: step-by-step hook */
-            break;
-        case OP_CAL: v = POP(m);
-            if (MPDM_IS_EXEC(v))
-                PUSH(m, mpdm_exec(v, POP(m), mpdm_aget(m->symtbl, m->tt - 1)));
+                for (i2 = 0; i2 < mpdm_size(w); i2++)
+                    PUSH(m, mpdm_aget(w, i2));
+
+                m->argc = i2;
+                mpdm_unref(w);
+                CALL(m, i1);
+            }
+            NEXT;
+        OP(OP_CLN): i1 = PC(m); k = SPOP(m);
+            if (k->type != V_INT && MPDM_IS_EXEC(v = PEEK(k)))
+                XCN(m, v, i1);
             else {
-                mpdm_aset(m->c_stack, MPDM_I(m->pc), m->cs++);
-                m->pc = mpdm_ival(v);
+                m->argc = i1;
+                CALL(m, IVAL(k));
+            }
+            NEXT;
+        OP(OP_FRM): i1 = PC(m); FRM(m, i1, PC(m)); NEXT;
+        OP(OP_TCL): i1 = PC(m); k = SPOP(m);
+            if (k->type != V_INT && MPDM_IS_EXEC(v = PEEK(k)))
+                XCN(m, v, i1);
+            else {
+                i2 = IVAL(k);
+
+                if (TCL(m, i1)) {
+                    m->pc = i2;
+                    VM_CHECK();
+                }
+                else {
+                    m->argc = i1;
+                    CALL(m, i2);
+                }
+            }
+            NEXT;
+        OP(OP_RET): if (m->cs) {
+                /* move the return value to the frame base */
+                SSET(&m->stack[m->fp], &m->stack[m->sp - 1]);
+                m->sp = m->fp + 1;
+
+                m->tt = m->c_stack[--m->cs];
+                m->fp = m->c_stack[--m->cs];
+                m->pc = m->c_stack[--m->cs];
             }
-            break;
-        case OP_RET: if (m->cs)
-                m->pc = mpdm_ival(mpdm_aget(m->c_stack, --m->cs));
             else
                 m->mode = VM_IDLE;
-            break;
-        case OP_ITE: i2 = IPOP(m);
-            if (mpdm_iterator(TOS(m), &i2, &v, &w)) {
+            NEXT;
+        OP(OP_ITE): i2 = IPOP(m);
+            i1 = m->stack[m->sp - 1].type;
+            switch (iterate(m, PEEK(&m->stack[m->sp - 1]), &i2, &v, &w)) {
+            case 1:
                 m->pc++;
-                PUSH(m, MPDM_I(i2));
+                IPUSH(m, i2);
                 h = PUSH(m, MPDM_H(0));
                 mpdm_hset_s(h, L"key", v);
-                mpdm_hset_s(h, L"value", w);
-            }
-            else {
+                mpdm_hset_s(h, L"value", i1 == V_LIT ? mpdm_clone(w) : w);
+                break;
+            case 0:
                 POP(m);
-                m->pc = mpdm_ival(PC(m));
+                m->pc = PC(m);
+                break;
+            default:
+                /* out of budget: iterate again when resumed */
+                IPUSH(m, i2);
+                m->pc--;
             }
-            break;
-        case OP_FRK: FRK(m); break;
-        }
-
-        m->ins++;
-
-        /* if out of slice time, break */        
-        if (max && clock() > max)
-            m->mode = VM_TIMEOUT;
-    }
+            NEXT;
+        OP(OP_ITS): switch (ITS(m, m->code[m->pc + 1])) {
+            case 1: m->pc += 2; break;
+            case 0: m->sp -= 2; m->pc = PC(m); break;
+            default: m->pc--; } NEXT;
+        OP(OP_GEN): GEN(m); NEXT;
+        OP(OP_YLD): --m->sp; m->mode = VM_YIELD; NEXT;
+        OP(OP_FRK): FRK(m); NEXT;
+    VM_END;
+
+    /* account the instructions run since the last check */
+    vm_account(m);
 
     return m->mode;
 }
@@ -1430,7 +4970,8 @@ mpdm_t nh3_compile(mpdm_t src)
     mpdm_ref(src);
 
     memset(&c, '\0', sizeof(c));
-    mpdm_set(&c.prg, MPDM_A(0));
+    mpdm_set(&c.pool, MPDM_A(0));
+    mpdm_set(&c.subs, MPDM_A(0));
 
     c.x = c.y = 1;
 
@@ -1438,19 +4979,89 @@ mpdm_t nh3_compile(mpdm_t src)
     if ((c.f = mpdm_get_filehandle(src)) == NULL)
         c.ptr = mpdm_string(src);
 
-    if (parse(&c) == 0 && gen(&c, c.node) == 0 && opt(&c) == 0)
-        r = MPDM_X2(exec_vm_a0, c.prg);
+    if (parse(&c) == 0) {
+        mpdm_t d = mpdm_ref(MPDM_H(0));
+        mpdm_t s = mpdm_ref(MPDM_H(0));
+
+        mpdm_set(&c.node, fold(c.node));
+
+        /* find the names that must be resolved dynamically */
+        mpdm_set(&c.dyn, MPDM_H(0));
+        scan(&c, c.node, d, s, 0);
+
+        mpdm_unref(s);
+        mpdm_unref(d);
+
+        mpdm_set(&c.scope, MPDM_A(0));
+        frame(&c, NULL, c.node);
+
+        if (c.error == 0 && opt(&c) == 0)
+            r = MPDM_X2(exec_vm_a0, prg(&c));
+    }
 
     mpdm_unref(src);
 
     /* cleanup */
     mpdm_set(&c.node,   NULL);
-    mpdm_set(&c.prg,    NULL);
+    mpdm_set(&c.pool,   NULL);
+    mpdm_set(&c.dyn,    NULL);
+    mpdm_set(&c.subs,   NULL);
+    mpdm_set(&c.scope,  NULL);
+    free(c.code);
+    free(c.lines);
 
     return r;
 }
 
 
+void nh3_budget(mpdm_t x, int max_ins, int msecs)
+/* sets the maximum instructions and running milliseconds (0, no limit) of a program */
+{
+    mpdm_t p = mpdm_aget(x, 1);
+
+    mpdm_aset(p, MPDM_I(max_ins), 3);
+    mpdm_aset(p, MPDM_I(msecs), 4);
+}
+
+
+/** VM handles **/
+
+struct nh3_vm *nh3_vm_new(mpdm_t x)
+/* creates a VM for a compiled program, suspended at its start */
+{
+    struct nh3_vm *m = new_vm(mpdm_aget(x, 1));
+
+    /* ready to run, as if it had run out of time */
+    m->mode         = VM_TIMEOUT;
+    m->resumable    = 1;
+
+    return m;
+}
+
+
+int nh3_vm_run(struct nh3_vm *m, int max_ins, int msecs)
+/* runs a VM for a slice of instructions and milliseconds (0, no limit) */
+{
+    /* only suspended VMs can continue */
+    if (m->mode == VM_TIMEOUT) {
+        m->max_ins  = max_ins;
+        m->msecs    = msecs;
+
+        vm_limit(m, NULL);
+        exec_vm(m);
+    }
+
+    return m->mode;
+}
+
+
+void nh3_vm_free(struct nh3_vm *m)
+/* destroys a VM */
+{
+    free_vm(m);
+}
+
+
 /** assembler **/
 
 static struct _nh3_assembler {
@@ -1471,34 +5082,50 @@ static struct _nh3_assembler {
     { OP_MOD,   L"MOD" },    { OP_NOT,   L"NOT" },    { OP_EQ,    L"EQ", },
     { OP_GT,    L"GT", },    { OP_GE,    L"GE", },    { OP_LT,    L"LT", },
     { OP_LE,    L"LE", },    { OP_REM,   L"REM" },    { OP_CAT,   L"CAT" },
-    { OP_ITE,   L"ITE" },    { OP_FMT,   L"FMT" },    { OP_LNI,   L"LNI" },
-    { OP_FRK,   L"FRK" },    { OP_NOP,   L"NOP" },
+    { OP_ITE,   L"ITE" },    { OP_FMT,   L"FMT" },    { OP_FRK,   L"FRK" },
+    { OP_ENT,   L"ENT" },    { OP_LDL,   L"LDL" },    { OP_STL,   L"STL" },
+    { OP_JT,    L"JT", },    { OP_NE,    L"NE", },    { OP_NEG,   L"NEG" },
+    { OP_INC,   L"INC" },    { OP_DEC,   L"DEC" },    { OP_ADL,   L"ADL" },
+    { OP_SBL,   L"SBL" },    { OP_GMS,   L"GMS" },    { OP_JEQ,   L"JEQ" },
+    { OP_JNE,   L"JNE" },    { OP_JGT,   L"JGT" },    { OP_JGE,   L"JGE" },
+    { OP_JLT,   L"JLT" },    { OP_JLE,   L"JLE" },    { OP_CLN,   L"CLN" },
+    { OP_FRM,   L"FRM" },    { OP_TCL,   L"TCL" },    { OP_ITS,   L"ITS" },
+    { OP_GEN,   L"GEN" },    { OP_YLD,   L"YLD" },    { OP_GTL,   L"GTL" },
+    { OP_NOP,   L"NOP" },
     { -1,       NULL }
 };
 
-void nh3_disasm(mpdm_t prg)
+void nh3_disasm_f(FILE *f, mpdm_t prg)
 {
     int n;
+    int32_t *code;
+    mpdm_t pool;
 
     mpdm_ref(prg);
 
-    for (n = 0; n < mpdm_size(prg); n++) {
-        nh3_op_t i = mpdm_ival(mpdm_aget(prg, n));
+    code = (int32_t *)mpdm_aget(prg, 0)->data;
+    pool = mpdm_aget(prg, 1);
+
+    for (n = 0; n < mpdm_size(mpdm_aget(prg, 0)); n++) {
+        nh3_op_t i = code[n];
         struct _nh3_assembler *a;
         int m = 0;
 
         while ((a = &nh3_assembler[m++])->op != -1 && a->op != i);
 
         if (a->op == -1)
-            printf("Error: opcode id #%d not found\n", i);
+            fprintf(f, "Error: opcode id #%d not found\n", i);
         else {
-            printf("%4d: ", n);
-            printf("%ls",   a->str);
+            fprintf(f, "%4d: ", n);
+            fprintf(f, "%ls",   a->str);
 
-            if (opcode_argc[i])
-                printf(" %ls", mpdm_string(mpdm_aget(prg, ++n)));
+            if (i == OP_LIT)
+                fprintf(f, " %ls", mpdm_string(mpdm_aget(pool, code[++n])));
+            else
+            for (m = 0; m < opcode_argc[i]; m++)
+                fprintf(f, " %d", code[++n]);
 
-            printf("\n");
+            fprintf(f, "\n");
         }
     }
 
@@ -1506,14 +5133,24 @@ void nh3_disasm(mpdm_t prg)
 }
 
 
+void nh3_disasm(mpdm_t prg)
+{
+    nh3_disasm_f(stdout, prg);
+}
+
+
 mpdm_t nh3_asm(mpdm_t src)
 {
-    mpdm_t r = mpdm_ref(MPDM_A(0));
+    mpdm_t r = NULL;
     mpdm_t l, s;
+    struct nh3_c c;
     int n = 0;
 
     mpdm_ref(src);
 
+    memset(&c, '\0', sizeof(c));
+    mpdm_set(&c.pool, MPDM_A(0));
+
     if (MPDM_IS_FILE(src))
         l = src;
     else
@@ -1549,14 +5186,10 @@ mpdm_t nh3_asm(mpdm_t src)
 
         /* not found? error assembling */
         if (a->op == -1) {
-            mpdm_unref(r);
-            r = NULL;
+            c.error = 1;
             break;
         }
 
-        /* push opcode */
-        mpdm_push(r, MPDM_I(a->op));
-
         /* args? */
         if (opcode_argc[a->op]) {
             while (*ptr == L' ') ptr++;
@@ -1564,15 +5197,31 @@ mpdm_t nh3_asm(mpdm_t src)
                     mnem[m] = ptr[m];
             mnem[m] = L'\0';
 
-            mpdm_push(r, MPDM_S(mnem));
+            /* literals go to the constant pool */
+            if (a->op == OP_LIT)
+                lit(&c, MPDM_S(mnem));
+            else {
+                wchar_t *e = mnem;
+
+                o(&c, a->op);
+
+                for (m = 0; m < opcode_argc[a->op]; m++)
+                    emit(&c, wcstol(e, &e, 10));
+            }
         }
+        else
+            o(&c, a->op);
     }
 
     mpdm_unref(l);
     mpdm_unref(src);
 
-    if (r != NULL)
-        r = MPDM_X2(exec_vm_a0, mpdm_unrefnd(r));
+    if (!c.error)
+        r = MPDM_X2(exec_vm_a0, prg(&c));
+
+    mpdm_set(&c.pool, NULL);
+    free(c.code);
+    free(c.lines);
 
     return r;
 }
@@ -1585,10 +5234,36 @@ void nh3_library_init(mpdm_t r, int argc, char *argv[]);
 void nh3_startup(int argc, char *argv[])
 {
     mpdm_startup();
+
+    park_mark   = mpdm_ref(MPDM_A(0));
+    end_mark    = mpdm_ref(MPDM_A(0));
+    sched_mutex = mpdm_ref(mpdm_new_mutex());
+    ready       = mpdm_ref(mpdm_new_semaphore(0));
+    sched_alarm = mpdm_ref(mpdm_new_semaphore(0));
+    spare_mutex = mpdm_ref(mpdm_new_mutex());
+    gen_mutex   = mpdm_ref(mpdm_new_mutex());
+    gens        = mpdm_ref(MPDM_A(0));
+
     nh3_library_init(mpdm_root(), argc, argv);
 }
 
 
 void nh3_shutdown(void)
 {
+    struct nh3_vm *m;
+
+    /* release the generators */
+    gen_sweep(1);
+
+    /* free the spare VMs */
+    mpdm_mutex_lock(spare_mutex);
+
+    while ((m = spare) != NULL) {
+        spare = m->next;
+        destroy_vm(m);
+    }
+
+    spares = 0;
+
+    mpdm_mutex_unlock(spare_mutex);
 }
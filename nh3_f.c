@@ -622,6 +622,44 @@ static mpdm_t M_sort(F_ARGS)
 }
 
 
+mpdm_t nh3_pmap(mpdm_t a, mpdm_t f, int grep);
+
+/**
+ * array.pmap - Maps an array through a subroutine, in parallel.
+ * @array: the array
+ * @sub: the subroutine
+ *
+ * Calls @sub for each element of @array (and its index), in parallel
+ * on the spawned subroutines' workers. Returns an array with the
+ * return values, in order.
+ * [Arrays]
+ * [Threading]
+ */
+/** array = array.pmap(sub); */
+static mpdm_t M_pmap(F_ARGS)
+{
+    return nh3_pmap(l, A0, 0);
+}
+
+
+/**
+ * array.pgrep - Filters an array through a subroutine, in parallel.
+ * @array: the array
+ * @sub: the subroutine
+ *
+ * Calls @sub for each element of @array (and its index), in parallel
+ * on the spawned subroutines' workers. Returns an array with the
+ * elements for which it returned true, in order.
+ * [Arrays]
+ * [Threading]
+ */
+/** array = array.pgrep(sub); */
+static mpdm_t M_pgrep(F_ARGS)
+{
+    return nh3_pmap(l, A0, 1);
+}
+
+
 /** HASH type **/
 
 static mpdm_t M_hsize(F_ARGS)
@@ -1167,6 +1205,8 @@ static mpdm_t M_rnd(F_ARGS)
 }
 
 
+mpdm_t nh3_park(mpdm_t d, int n);
+
 /**
  * sys.sleep - Sleeps a number of milliseconds.
  *
@@ -1176,9 +1216,70 @@ static mpdm_t M_rnd(F_ARGS)
 /** sys.sleep(msecs); */
 static mpdm_t F_sleep(F_ARGS)
 {
-    mpdm_sleep(mpdm_ival(mpdm_aget(a, 0)));
+    /* not called from a VM (no symbol table): nobody would take
+       the park token, so sleep right here */
+    if (l == NULL) {
+        mpdm_sleep(mpdm_ival(mpdm_aget(a, 0)));
+        return NULL;
+    }
 
-    return NULL;
+    /* the VM sleeps (a task, giving way to others) */
+    return nh3_park(NULL, mpdm_ival(mpdm_aget(a, 0)));
+}
+
+
+mpdm_t nh3_wait(mpdm_t l, int all);
+
+/**
+ * wait_all - Waits for a list of spawned subroutines.
+ * @tasks: array of spawned subroutines
+ *
+ * Waits until all the spawned subroutines in @tasks finish.
+ * Returns an array with their return values (NULL for the
+ * cancelled ones).
+ * [Threading]
+ */
+/** values = wait_all(tasks); */
+static mpdm_t F_wait_all(F_ARGS)
+{
+    return nh3_wait(A0, 1);
+}
+
+
+/**
+ * wait_any - Waits for any of a list of spawned subroutines.
+ * @tasks: array of spawned subroutines
+ *
+ * Waits until any of the spawned subroutines in @tasks finishes.
+ * Returns it (its value can then be taken with wait()).
+ * [Threading]
+ */
+/** task = wait_any(tasks); */
+static mpdm_t F_wait_any(F_ARGS)
+{
+    return nh3_wait(A0, 0);
+}
+
+
+mpdm_t nh3_range(mpdm_t from, mpdm_t to, mpdm_t step);
+
+/**
+ * range - Returns a lazy numeric range.
+ * @from: first number
+ * @to: last number
+ * @step: increment (optional)
+ *
+ * Returns an iterable that gives the numbers from @from to @to
+ * (both included) by @step, without building them, so it can be
+ * walked by foreach in constant memory. If @step is not given,
+ * it's 1 or -1, depending on the direction.
+ * [Arrays]
+ */
+/** r = range(from, to); */
+/** r = range(from, to, step); */
+static mpdm_t F_range(F_ARGS)
+{
+    return nh3_range(A0, A1, A2);
 }
 
 
@@ -1267,6 +1368,8 @@ void nh3_library_init(mpdm_t r, int argc, char *argv[])
     mpdm_hset_s(v, L"rnd",          MPDM_X(M_rnd));
     mpdm_hset_s(v, L"fmt",          MPDM_X(M_fmt));
     mpdm_hset_s(v, L"join",         MPDM_X(M_join));
+    mpdm_hset_s(v, L"pmap",         MPDM_X(M_pmap));
+    mpdm_hset_s(v, L"pgrep",        MPDM_X(M_pgrep));
 
     mpdm_hset_s(v, L"seek",         MPDM_X(M_seek));
 
@@ -1328,6 +1431,9 @@ void nh3_library_init(mpdm_t r, int argc, char *argv[])
     mpdm_hset_s(v, L"STDERR",           MPDM_F(stderr));
 
     mpdm_hset_s(r, L"new",      MPDM_X(F_new));
+    mpdm_hset_s(r, L"wait_all", MPDM_X(F_wait_all));
+    mpdm_hset_s(r, L"wait_any", MPDM_X(F_wait_any));
+    mpdm_hset_s(r, L"range",    MPDM_X(F_range));
 
     /* version */
     v = mpdm_hset_s(r, L"NH3", MPDM_H(0));
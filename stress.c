@@ -29,6 +29,7 @@
 #include "nh3.h"
 
 void nh3_disasm(mpdm_t prg);
+void nh3_disasm_f(FILE *f, mpdm_t prg);
 mpdm_t nh3_asm(mpdm_t code);
 
 /* total number of tests and oks */
@@ -52,6 +53,173 @@ void do_disasm(char *prg)
 }
 
 
+int test_result(char *prg, int ok, int line)
+/* accounts the result of a test */
+{
+    char tmp[1024];
+
+    sprintf(tmp, "stress.c:%d: error: test #%d \"%s\" (line %d): %s\n", line, tests + 1, prg, line, ok ? "OK!" : "*** Failed ***");
+
+    if (verbose)
+        printf("%s", tmp);
+
+    tests++;
+
+    if (ok)
+        oks++;
+    else
+        failed_msgs[i_failed_msgs++] = strdup(tmp);
+
+    return ok;
+}
+
+
+#define do_peep(s, y, n) _do_peep(s, y, n, __LINE__)
+
+void _do_peep(char *prg, char *yes, char *no, int line)
+/* tests that the disassembled code of prg has yes and not no */
+{
+    mpdm_t v;
+    FILE *f;
+    char code[8192];
+    int ok = 0;
+
+    v = mpdm_ref(nh3_compile(MPDM_MBS(prg)));
+
+    if (v != NULL && (f = tmpfile()) != NULL) {
+        nh3_disasm_f(f, mpdm_aget(v, 1));
+
+        rewind(f);
+        code[fread(code, 1, sizeof(code) - 1, f)] = '\0';
+        fclose(f);
+
+        ok = strstr(code, yes) != NULL && (no == NULL || strstr(code, no) == NULL);
+    }
+
+    if (!test_result(prg, ok, line) && v != NULL) {
+        printf("Disasm:\n");
+        nh3_disasm(mpdm_aget(v, 1));
+    }
+
+    mpdm_unref(v);
+}
+
+
+#define do_error(s, e) _do_error(s, e, __LINE__)
+
+void _do_error(char *prg, wchar_t *error, int line)
+/* tests that running prg fails with the error message */
+{
+    mpdm_t v;
+    int ok = 0;
+
+    mpdm_hset_s(mpdm_root(), L"ERROR", NULL);
+
+    v = mpdm_ref(nh3_compile(MPDM_MBS(prg)));
+
+    if (v != NULL) {
+        mpdm_void(mpdm_exec(v, NULL, NULL));
+        ok = mpdm_cmp_s(mpdm_hget_s(mpdm_root(), L"ERROR"), error) == 0;
+    }
+
+    if (!test_result(prg, ok, line)) {
+        printf("ERROR:\n");
+        mpdm_dump(mpdm_hget_s(mpdm_root(), L"ERROR"));
+    }
+
+    mpdm_unref(v);
+}
+
+
+#define do_budget(s, i, t) _do_budget(s, i, t, __LINE__)
+
+void _do_budget(char *prg, int max_ins, int msecs, int line)
+/* tests that running prg runs out of its budget */
+{
+    mpdm_t v;
+    int ok = 0;
+
+    v = mpdm_ref(nh3_compile(MPDM_MBS(prg)));
+
+    if (v != NULL) {
+        nh3_budget(v, max_ins, msecs);
+        ok = mpdm_ival(mpdm_exec(v, NULL, NULL)) == VM_TIMEOUT;
+    }
+
+    test_result(prg, ok, line);
+
+    mpdm_unref(v);
+}
+
+
+#define do_slices(s1, s2) _do_slices(s1, s2, __LINE__)
+
+void _do_slices(char *prg1, char *prg2, int line)
+/* tests that two programs run interleaved in slices until the end */
+{
+    mpdm_t v1, v2;
+    struct nh3_vm *m1, *m2;
+    int r1, r2, n = 0;
+
+    v1 = mpdm_ref(nh3_compile(MPDM_MBS(prg1)));
+    v2 = mpdm_ref(nh3_compile(MPDM_MBS(prg2)));
+
+    m1 = nh3_vm_new(v1);
+    m2 = nh3_vm_new(v2);
+
+    do {
+        r1 = nh3_vm_run(m1, 1000, 0);
+        r2 = nh3_vm_run(m2, 1000, 0);
+        n++;
+    } while (r1 == VM_TIMEOUT || r2 == VM_TIMEOUT);
+
+    nh3_vm_free(m2);
+    nh3_vm_free(m1);
+
+    test_result(prg1, n > 10 && r1 == VM_IDLE && r2 == VM_IDLE &&
+        mpdm_ival(mpdm_hget_s(mpdm_root(), L"T")) == 10000 &&
+        mpdm_ival(mpdm_hget_s(mpdm_root(), L"TT")) == 10000, line);
+
+    mpdm_unref(v2);
+    mpdm_unref(v1);
+}
+
+
+#define do_sliced(s, t) _do_sliced(s, t, __LINE__)
+
+void _do_sliced(char *prg, mpdm_t t_value, int line)
+/* tests that a program run in slices ends with T == t_value
+   (or, if it's NULL, that it's still running after 100 slices) */
+{
+    mpdm_t v;
+    struct nh3_vm *m;
+    int r = VM_ERROR, n = 0;
+
+    mpdm_ref(t_value);
+
+    v = mpdm_ref(nh3_compile(MPDM_MBS(prg)));
+
+    if (v != NULL) {
+        m = nh3_vm_new(v);
+
+        do
+            r = nh3_vm_run(m, 1000, 0);
+        while (r == VM_TIMEOUT && (t_value != NULL || ++n < 100));
+
+        nh3_vm_free(m);
+    }
+
+    if (t_value == NULL)
+        test_result(prg, r == VM_TIMEOUT, line);
+    else
+        test_result(prg, r == VM_IDLE &&
+            mpdm_cmp(mpdm_hget_s(mpdm_root(), L"T"), t_value) == 0, line);
+
+    mpdm_unref(v);
+    mpdm_unref(t_value);
+}
+
+
 void _do_test(char *prg, mpdm_t t_value, int line)
 {
     mpdm_t v;
@@ -143,6 +311,19 @@ int main(int argc, char *argv[])
     do_test("T = 1 + 3 * 5;", MPDM_I(1 + 3 * 5));
     do_test("T = (1 + 3) * 5;", MPDM_I((1 + 3) * 5));
     do_test("T = 1 + (3 * 5);", MPDM_I(1 + (3 * 5)));
+    do_test("T = 7 / 2;", MPDM_R(3.5));
+    do_test("T = 1.5 * 2 + 1;", MPDM_I(4));
+    do_test("T = 2147483647 + 1;", MPDM_R(2147483648.0));
+    do_test("T = -2147483647 - 10;", MPDM_R(-2147483657.0));
+    do_test("T = '2.5' + 1;", MPDM_R(3.5));
+    do_test("T = 0x10 + 0b11 + 010;", MPDM_I(0x10 + 3 + 010));
+    do_test("T = 1e3 + 0.5;", MPDM_R(1000.5));
+    do_test("T = 4294967296;", MPDM_R(4294967296.0));
+    do_test("T = 0x1f;", MPDM_I(31));
+    do_test("T = 017;", MPDM_I(15));
+    do_test("T = 2.50;", MPDM_R(2.5));
+    do_test("T = 0x10 ~ ' ' ~ 1.50 ~ ' ' ~ 010;", MPDM_LS(L"16 1.5 8"));
+    do_test("var r = 0.0; T = 1; if (r) T = 2;", MPDM_I(1));
 
     v = mpdm_ref(MPDM_A(0));
     mpdm_push(v, MPDM_I(1));
@@ -207,6 +388,14 @@ int main(int argc, char *argv[])
     do_test("sub pi { return 3.14; } T = pi();", MPDM_R(3.14));
     do_test("sub pi() { return 3.14; } T = pi();", MPDM_R(3.14));
     do_test("sub sum(a, b) { return a + b; } T = sum(5, 6);", MPDM_I(11));
+    do_test("sub f(a, b, c) { return [a, b, c]; } T = f(1).size() + f(1, 2, 3, 4).size();", MPDM_I(6));
+    do_test("sub f(a, b) { var c = 3; return c; } T = f(1, 2, 5, 6);", MPDM_I(3));
+    do_test("sub f(a) { a.push(3); return a.size(); } T = f([1, 2]) + f([1, 2]);", MPDM_I(6));
+    do_test("sub f(x) { var g = sub () { return x * 2; }; return g(); } T = f(21);", MPDM_I(42));
+    do_test("sub f(n, a) { if (n == 0) return a; return f(n - 1, a + 1); } T = f(300000, 0);", MPDM_I(300000));
+    do_test("sub ev(n) { if (n == 0) return 1; return od(n - 1); } sub od(n) { if (n == 0) return 0; return ev(n - 1); } T = ev(100001);", MPDM_I(0));
+    do_test("sub a(x) { return b(); } sub b() { return x; } T = a(5);", MPDM_I(5));
+    do_test("sub f(n) { foreach [1] { return g(n); } } sub g(n) { return n + value; } T = f(10);", MPDM_I(11));
 
     do_test("T = (1 == 1);", MPDM_I(1));
     do_test("T = (1 == 2);", MPDM_I(0));
@@ -263,6 +452,133 @@ int main(int argc, char *argv[])
     do_test("T = 0; foreach 10 ++T;", MPDM_I(10));
     do_test("T = 0; foreach [1, 3, 7, 'a', 9] { ++T; }", MPDM_I(5));
     do_test("T = 0; foreach { 'a': 1, 'b': 2 } ++T;", MPDM_I(2));
+    do_test("T = 0; foreach [[1, 2], [3, 4]] { value[0] = 10; T += value[0] + value[1]; }", MPDM_I(26));
+
+    /* literals are shared but never modified */
+    do_test("sub lt(i) { var l = [1, 2, [3]]; l[i] += 10; l[2][0] += 1; return l[i] + l[2][0]; } lt(0); T = lt(1);", MPDM_I(16));
+    do_test("sub lt { return [1, 2, 3]; } lt().push(4); T = lt().size();", MPDM_I(3));
+    do_test("sub lt(i) { var l = [1, 2, 3]; var x = l[i]; l[i] = 9; return x * 10 + l[i]; } lt(1); T = lt(1);", MPDM_I(29));
+    do_test("sub lt { var l = [[1], 2]; var x = l[0]; x.push(5); l.push(3); return l[0].size() * 10 + l.size(); } lt(); T = lt();", MPDM_I(23));
+    do_test("sub lt { var l = [[1, 2]]; l[0][1] = 7; return l[0][1]; } lt(); T = lt();", MPDM_I(7));
+    do_test("sub lt(l) { l[0] = 5; return l[0]; } lt([1]); T = lt([1]) + lt([1]);", MPDM_I(10));
+    do_peep("sub lt(i) { var l = [1, 2, 3]; return l[i]; }", "GTL", NULL);
+    do_test("T = [1, 2, [3, 4]][2][1];", MPDM_I(4));
+    do_test("T = [1, 2][5] == NULL;", MPDM_I(1));
+    do_test("T = 0; if ([1, 2][5] == NULL) T += 1; if ([1, 2][5] != NULL) T += 10;", MPDM_I(1));
+
+    /* locals in frame slots and dynamic scope */
+    do_test("sub fact(n) { if (n < 2) return 1; return n * fact(n - 1); } T = fact(10);", MPDM_I(3628800));
+    do_test("sub g { return x * 2; } sub f(x) { var y = 3; return g() + y; } T = f(5);", MPDM_I(13));
+    do_test("var y = 1; foreach [1, 2] { var y = 2; } T = y;", MPDM_I(1));
+    do_test("sub f(a) { if (0) { var b = 1; } return b; } T = f(1, 99);", NULL);
+    do_test("sub g { return a; } sub f(a) { var b; return [a, b, g()].join(','); } T = f(1, 2);", MPDM_LS(L"1,,1"));
+    do_test("var value = 7; T = 0; foreach [1, 2, 3] T += value; T += value;", MPDM_I(13));
+    do_test("sub f(l) { foreach l { if (value == 2) return value; } } var n = 0; T = 0; while (n < 10) { T += f([1, 2, 3]); ++n; }", MPDM_I(20));
+    do_test("var n; n ||= 3; ++n; n *= 2; T = n;", MPDM_I(8));
+
+    /* inline caches */
+    do_test("sub a1 { return A1; } var A1 = 1, h = {}; T = 0; foreach [1, 2] { T += h.A1; var h.A1 = 10; A1 = 100; }", MPDM_I(11));
+    do_test("var s = 'abc', h = {}; T = 0; foreach [1, 2, 3] { T += s.size() + h.size(); }", MPDM_I(9));
+    do_test("var value = 7; sub g { return value; } sub f { var r = g(); return r; } f(); var s = 0; "
+        "foreach [1, 2, 3] s += g(); T = s;", MPDM_I(6));
+
+    /* peephole optimizer */
+    do_peep("var a = 1; T = [1, 2, [3, 4]];", "LIT ARRAY", "APU");
+    do_test("var a = 1; T = [1, 2, [3, 4]].fmt('%j');", MPDM_LS(L"[1,2,[3,4]]"));
+    do_peep("var a = 1; T = -a; T = -5;", "NEG", "MUL");
+    do_peep("var a = 1; T = -5;", "LIT -5", "NEG");
+    do_peep("var a = 1; if (a != 2) T = 1;", "NE", "NOT");
+    do_peep("var a = 1; while (!a) a = 1;", "JT", "NOP");
+    do_test("var a = 3; T = -a - -2.5 + -(-4);", MPDM_R(3.5));
+    do_test("var a = 1, b = 2; T = 0; if (a != b) T = 1; if (a != 1) T = 2;", MPDM_I(1));
+    do_test("var a = 0; T = 0; while (!a) { ++T; a = T > 3; }", MPDM_I(4));
+    do_test("sub f(a, b) { if (a) { if (b) return 1; else T = 2; } else T = 3; return T; } T = f(1, 0) * 10 + f(0, 1);", MPDM_I(23));
+    do_test("var a = 0, b = 5; T = a || b; T += !a && b;", MPDM_I(10));
+
+    /* constant folding */
+    do_peep("var a; T = 1 + 3 * 5;", "LIT 16", "MUL");
+    do_peep("var a; T = '/d/quotes.csv?s=' ~ 'x';", "LIT /d/quotes.csv?s=x", "CAT");
+    do_peep("var a; T = { a: 1, b: [2, 3], c: { d: -4 } };", "LIT", "HSH");
+    do_peep("var a; T = 1 % 0;", "MOD", NULL);
+    do_test("T = 1 + 3 * 5 - 10 / 4;", MPDM_R(13.5));
+    do_test("T = (2 > 1) + (3 == 3.0) + (1 != 1) + !0 + (7 & 3) + (1 << 4);", MPDM_I(22));
+    do_test("T = 2147483647 + 1;", MPDM_R(2147483648.0));
+    do_test("T = -(1 - 3) ~ ('%03d' $ 7);", MPDM_LS(L"2007"));
+    do_test("var a = 2; T = a * 3 + 1 * 2;", MPDM_I(8));
+    do_test("T = { a: 1, b: [2, 3], c: { d: -4 } }.c.d * { a: 1, b: [2, 3] }.b[1];", MPDM_I(-12));
+    do_test("sub h { var x = { a: 1 }; x.a += 1; return x.a; } h(); T = h();", MPDM_I(2));
+
+    /* fused in-place operations */
+    do_peep("var n = 0; ++n; n += 2; --n; n -= 3;", "INC", "LDL");
+    do_peep("var n = 0; n += 2; n -= 3;", "SBL", "LDL");
+    do_peep("var h = { a: 1 }; h.a += 1; h.a *= 3;", "GMS", "DP2");
+    do_test("var n = 2147483646; ++n; ++n; T = n;", MPDM_R(2147483648.0));
+    do_test("var n = 1.5, m = 10; n += 1; m -= 0.5; --m; T = n + m;", MPDM_R(11.0));
+    do_test("var s = 'a', n = 3; s ~= 'b'; s ~= n; n *= n; n %= 5; T = s ~ n;", MPDM_LS(L"ab34"));
+    do_test("var h = { a: 1, b: 0 }, l = [1, 2]; h.a += 1; h.a *= 3; h.b += 5; l[1] -= 1; l[0] ~= 'x'; T = h.a + h.b + l[1] ~ l[0];", MPDM_LS(L"121x"));
+    do_test("T = 1; T += (T = 5);", MPDM_I(6));
+    do_test("var n = 1; n += (n = 5); T = n;", MPDM_I(6));
+    do_test("T = 0; foreach [1, 2, 3] { var x = value; x += T; T += x; }", MPDM_I(11));
+
+    /* fused compare and branch */
+    do_peep("var n = 0; while (n < 10) ++n;", "JLT", " LT");
+    do_peep("var a = 1, b = 2; if (a == 1 && b != 1) a = 3;", "JNE", "JF");
+    do_test("var n = 0; T = 0; while (n <= 10) { if (n > 5) T += n; ++n; }", MPDM_I(40));
+    do_test("var a = 1, b = 2; T = 0; if (a == 1 && b != 1) T = 3; if (a >= 2 || b < 3) T += 4; if (a > 1 || b <= 1) T += 8;", MPDM_I(7));
+    do_test("var a = 'x', b = NULL; T = 0; if (a && b == NULL) T = 1; else T = 2;", MPDM_I(1));
+    do_test("var z = 0 / 0; T = 0; if (z < 1) T += 1; if (z >= 1) T += 2; if (z != z) T += 4;", MPDM_I(4));
+
+    /* foreach key and value in frame slots */
+    do_peep("var s = 0; foreach [1, 2, 3] s += value;", "ITS", "TPU");
+    do_peep("sub f { return value; } var s = 0; foreach [1, 2, 3] s += f();", "ITE", "ITS");
+    do_test("var s = 0; foreach [1, 2, 3] s += key * value; T = s;", MPDM_I(8));
+    do_test("sub f { return value * 10; } var s = 0; foreach [1, 2, 3] s += f(); T = s;", MPDM_I(60));
+    do_test("sub g { return q; } T = 0; foreach [1, 2, 3] { var q = value; T += g(); }", MPDM_I(6));
+    do_test("var s = ''; foreach [1, 2] foreach ['a', 'b'] s = s ~ value ~ key; T = s;", MPDM_LS(L"a0b1a0b1"));
+    do_test("var a = []; foreach [[1], [2]] { value.push(0); a.push(value.size()); } foreach [[1], [2]] a.push(value.size()); "
+        "T = a.join(',');", MPDM_LS(L"2,2,1,1"));
+
+    /* lazy ranges and generators */
+    do_test("T = 0; foreach range(1, 10) T += value;", MPDM_I(55));
+    do_test("var s = ''; foreach range(10, 1, -3) s = s ~ value; T = s;", MPDM_LS(L"10741"));
+    do_test("T = 0; foreach range(0, 1, 0.25) T += value;", MPDM_R(2.5));
+    do_test("sub sq(n) { var i = 0; while (i < n) { yield i * i; ++i; } } var s = ''; foreach sq(4) s = s ~ key ~ value; T = s;", MPDM_LS(L"00112439"));
+    do_test("sub evens(l) { foreach l if (value % 2 == 0) yield value; } T = 0; foreach evens(range(1, 100)) T += value;", MPDM_I(2550));
+    do_test("sub g(a) { yield a; yield a + 1; } var x = g(5); T = x() * 10 + x(); if (x() == NULL) T += 1;", MPDM_I(57));
+    do_test("sub g(a, b) { yield a; yield b; } var s = 0; pforeach (s: sum) g(3, 4) s += value; T = s;", MPDM_I(7));
+    do_test("sub g(n) { while (1) yield ++n; } sub f { foreach g(0) if (value > 3) return value; } var i = 0; T = 0; while (i < 100) { T += f(); ++i; }", MPDM_I(400));
+    do_test("sub g(a) { yield a; yield a + 1; } var i = 0; T = 0; while (i < 50) { var x = g(i); T += x(); ++i; }", MPDM_I(1225));
+    do_budget("sub g(n) { while (1) ++n; yield n; } foreach g(0) T = value;", 100000, 0);
+    do_budget("sub g(n) { while (1) ++n; yield n; } foreach g(0) T = value;", 0, 200);
+    do_budget("sub g(n) { while (1) ++n; yield n; } var x = g(0); T = x();", 100000, 0);
+    do_budget("sub g(n) { while (1) yield ++n; } var s = 0; pforeach (s: sum) g(0) s += value;", 10000, 0);
+    do_test("T = (range(1, 4)->value * 2).join(',');", MPDM_LS(L"2,4,6,8"));
+
+    /* source lines from the line table */
+    do_peep("var a = 1;\na = 2;\n", "STL", "LNI");
+    do_error("var a = 1;\nwhile (a < 3) {\n    ++a;\n}\nT = b;\n", L":5: error: undefined symbol b");
+    do_error("sub f {\n    return q;\n}\n\nvar x = 1;\nf();\n", L":2: error: undefined symbol q");
+    do_error("var x = 1; x = z;", L":1: error: undefined symbol z");
+
+    /* execution budget */
+    do_budget("T = 0; while (1) ++T;", 100000, 0);
+    do_budget("T = 0; while (T >= 0) { T += 1; if (T > 5) T = 0; }", 0, 100);
+    do_budget("sub f(n) { return f(n + 1); } T = f(0);", 10000, 0);
+    do_budget("sub f { foreach [1, 2] f(); } f();", 0, 100);
+    do_budget("sub f(c) { c.read(); } var t = &f; t.read();", 0, 100);
+    do_budget("if ([1, 2].pmap(sub (v) { while (1); }) == NULL) while (1);", 100000, 0);
+    do_budget("var i = 0; while (i < 20) { [1, 2, 3, 4].pmap(sub (v) { var n = 0; while (n < 2000) ++n; return v; }); ++i; }", 100000, 0);
+    do_test("T = 0; while (T < 1000) ++T;", MPDM_I(1000));
+
+    /* resumable VMs */
+    do_slices("T = 0; while (T < 10000) ++T;", "TT = 0; foreach 10000 ++TT;");
+    do_slices("sub g(n) { while (n) yield --n; } T = 0; foreach g(10000) ++T;",
+        "sub g(n) { while (1) yield ++n; } var x = g(0); TT = 0; while (TT < 10000) TT = x();");
+    do_sliced("sub f(c) { while (1); } var t = &f; T = 0; if (t.wait() == NULL) T = 1;", MPDM_I(1));
+    do_sliced("sub f(c) { c.write(c.read() * 2); } var t = &f; t.write(21); T = t.read();", MPDM_I(42));
+    do_sliced("T = [1, 2].pmap(sub (v) { while (1); });", NULL);
+    do_sliced("T = [1, 2, 3].pmap(sub (v) { var i = 0; while (i < 2000) ++i; return v * 2; }).join(',');", MPDM_LS(L"2,4,6"));
+    do_sliced("sub g(n) { var i = 0; while (i < n) { yield i; ++i; } } var s = 0; pforeach (s: sum) g(1000) s += value; T = s;", MPDM_I(499500));
 
     /* nested subroutines */
     do_test("sub circlen(r) { sub pi() { return 3.14; } return 2 * pi() * r; } T = circlen(2);", MPDM_R(6.28 * 2));
@@ -284,6 +600,53 @@ int main(int argc, char *argv[])
     do_test("#!/usr/bin/env nh33\nT = 10;", MPDM_I(10));
 
     do_test("sub sqr(c) { var v = c.read(); c.write(v * v); } var c = &sqr; c.write(1234); T = c.read();", MPDM_I(1234 * 1234));
+    do_test("sub sqr(c) { var v = c.read(); c.write(v * v); } var l = [], n = 0; while (n < 1000) { var c = &sqr; l.push(c); c.write(n); ++n; } "
+        "T = 0; foreach l T += value.read();", MPDM_I(332833500));
+    do_test("sub sqr(c) { var v = c.read(); c.write(v * v); } sub fwd(c) { var o = c.read(); o.write(c.read() * 2); } "
+        "var s = &sqr, f = &fwd; f.write(s); f.write(5); T = s.read();", MPDM_I(100));
+    do_test("sub nap(c) { sys.sleep(10); c.write(c.read() + 1); } var c = &nap; c.write(1); T = c.read();", MPDM_I(2));
+
+    /* called from C, with no VM to take a park token, it sleeps right there */
+    {
+        mpdm_t a = mpdm_ref(MPDM_A(1));
+
+        mpdm_aset(a, MPDM_I(10), 0);
+        test_result("sys.sleep(10) from C", mpdm_exec(mpdm_hget_s(mpdm_hget_s(mpdm_root(), L"sys"), L"sleep"), a, NULL) == NULL, __LINE__);
+        mpdm_unref(a);
+    }
+
+    do_test("sub sqr(c) { var v = c.read(); return v * v; } var t = &sqr; t.write(12); T = t.wait() + t.wait();", MPDM_I(288));
+    do_test("sub sqr(c) { var v = c.read(); return v * v; } var l = [], n = 0; while (n < 100) { var t = &sqr; l.push(t); t.write(n); ++n; } "
+        "T = 0; foreach wait_all(l) T += value;", MPDM_I(328350));
+    do_test("sub slow(c) { sys.sleep(50); return 1; } sub fast(c) { return 2; } var s = &slow, f = &fast; T = wait_any([s, f]).wait();", MPDM_I(2));
+    do_test("sub loop(c) { while (1); } var t = &loop; t.cancel(); T = t.wait();", NULL);
+    do_test("sub blocked(c) { c.read(); } var t = &blocked; t.cancel(); T = wait_all([t]).size();", MPDM_I(1));
+    do_test("sub blocked(c) { c.read(); } var t = &blocked; sys.sleep(20); t.cancel(); T = t.wait();", NULL);
+    do_test("sub f(c) { return c.read(); } var a = &f, b = &f; b.write(5); var x = wait_any([a, b]); a.write(3); T = x.wait() * 10 + wait_any([a]).wait();", MPDM_I(53));
+    do_test("sub inc(c) { var l = [c.read()]; return l[0] + 1; } var s = 0, n = 0; while (n < 200) { var t = &inc; t.write(n); s += t.wait(); ++n; } "
+        "T = s;", MPDM_I(20100));
+    do_budget("sub l(c) { while (1); } var t = &l; t.wait();", 0, 200);
+    do_budget("sub l(c) { while (1); } var t = &l; t.wait(); while (1);", 100000, 0);
+    do_test("T = [1, 2, 3, 4, 5].pmap(sub (v) { return v * 10; }).join(',');", MPDM_LS(L"10,20,30,40,50"));
+    do_test("T = [1, 2, 3, 4, 5, 6].pgrep(sub (v) { return v % 2; }).join(',');", MPDM_LS(L"1,3,5"));
+    do_test("T = [].pmap(sub (v) { return v; }).size();", MPDM_I(0));
+    do_test("sub sq(v, i) { return v * v + i; } var a = [], n = 0; while (n < 1000) { a.push(n); ++n; } "
+        "var r = a.pmap(sq); T = r[999] + r.size();", MPDM_I(998001 + 999 + 1000));
+    do_budget("[1, 2, 3].pmap(sub (v) { while (1); });", 0, 200);
+    do_budget("var r = [1, 2, 3].pgrep(sub (v) { while (1); }); if (r == NULL) while (1);", 100000, 0);
+    do_test("var s = 5; pforeach (s: sum) [1, 2, 3, 4] s += value; T = s;", MPDM_I(15));
+    do_test("var a, b; pforeach (a: min, b: max) [3, 1, 4, 1, 5, 9, 2, 6] { if (a == NULL || value < a) a = value; "
+        "if (b == NULL || value > b) b = value; } T = a * 10 + b;", MPDM_I(19));
+    do_test("var l; pforeach (l: concat) [1, 2, 3, 4, 5] l = (l || []) ~ [value * 2]; T = l.join(',');", MPDM_LS(L"2,4,6,8,10"));
+    do_test("var p; pforeach (p: sub (a, b) { return a * b; }) [1, 2, 3, 4, 5] p = (p || 1) * value; T = p;", MPDM_I(120));
+    do_test("var k = ''; pforeach (k: concat) { a: 1, b: 2, c: 3 } if (value > 1) k = k ~ key; T = k.size();", MPDM_I(2));
+    do_test("var n = 0; pforeach (n: sum) [] n += 1; T = n;", MPDM_I(0));
+    do_test("var s = 0; pforeach (s: sum) 5 s += value; T = s;", MPDM_I(10));
+    do_test("sub f(l, k) { var s = 0; pforeach (s: sum) l s += value * k; return s; } T = f([1, 2, 3], 2);", MPDM_I(12));
+    do_budget("var s = 0; pforeach (s: sum) [1, 2] { while (1); }", 0, 200);
+    do_budget("var s = 5; pforeach (s: sum) [1, 2, 3] { s += value; while (value > 1); } if (s == 5) while (1);", 100000, 0);
+    do_test("sub sq(v) { return v * v; } var a = [], n = 0; while (n < 1000) { a.push(n); ++n; } "
+        "var s = 0, c = 0; pforeach (s: sum, c: sum) a { s += sq(value); ++c; } T = s + c;", MPDM_I(332833500 + 1000));
 
     /* mappings */
     do_test("T = ([1 2 3 4]->value * 2).fmt('%j');", MPDM_LS(L"[2,4,6,8]"));